@@ -3,17 +3,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <limits.h>
 #include <getopt.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#define FRAME_MAX	65536	/* output frame payload */
+
+/* frame types, keep in sync with server.c */
+enum frame_type {
+	FRAME_EXEC = 0,
+	FRAME_STDOUT,
+	FRAME_STDERR,
+	FRAME_EXIT,
+};
+
+/* in network byte order */
+struct frame {
+	uint32_t		id;
+	uint32_t		type;
+	uint32_t		len;
+};
+
 struct client {
 	char			buf[LINE_MAX];
-	int			wfd;
+	uint32_t		next_id;
+	unsigned		inflight;
+	unsigned		rlen;
+	char			rbuf[sizeof(struct frame)+FRAME_MAX];
 	const struct process	*p;
 };
 
@@ -22,25 +46,25 @@ static struct process {
 	const char		*prompt;
 	const char		*server;
 	int			port;
+	unsigned		jobs;
+	int			sd;
 	socklen_t		salen;
 	struct sockaddr_storage	ssa;
-	struct sockaddr_storage	csa;
-	int			rfd;
 	const char		*progname;
 	const char		*const opts;
 	const struct option	lopts[];
 } process = {
-	.client[0].wfd	= -1,
 	.prompt		= "client",
 	.server		= "127.0.0.1",
 	.port		= 9999,
+	.jobs		= 1,
+	.sd		= -1,
 	.salen		= -1,
 	.ssa.ss_family	= AF_UNSPEC,
-	.csa.ss_family	= AF_UNSPEC,
-	.rfd		= -1,
 	.progname	= NULL,
-	.opts		= "h",
+	.opts		= "j:h",
 	.lopts		= {
+		{"jobs",	required_argument,	NULL,	'j'},
 		{"help",	no_argument,		NULL,	'h'},
 		{NULL, 0, NULL, 0},
 	},
@@ -49,11 +73,16 @@ static struct process {
 static void usage(const struct process *restrict p, FILE *s, int status)
 {
 	const struct option *o;
-	fprintf(s, "usage: %s [-%s] [server IP address]\n", p->progname, p->opts);
+	fprintf(s, "usage: %s [-%s] [server IP address[:port] | path | @name]\n",
+		p->progname, p->opts);
 	fprintf(s, "options:\n");
 	for (o = p->lopts; o->name; o++) {
 		fprintf(s, "\t-%c,--%s:", o->val, o->name);
 		switch (o->val) {
+		case 'j':
+			fprintf(s, "\tCommands in flight on the connection (default: %u)\n",
+				p->jobs);
+			break;
 		case 'h':
 			fprintf(s, "\tDisplay this message and exit\n");
 			break;
@@ -85,105 +114,150 @@ static char *fetch(struct client *ctx)
 	cmdline = fgets(ctx->buf, sizeof(ctx->buf), stdin);
 	if (cmdline == NULL)
 		return NULL;
-	cmdline[strlen(cmdline)-1] = '\0'; /* drop newline */
+	cmdline[strcspn(cmdline, "\n")] = '\0'; /* drop newline */
 	return cmdline;
 }
 
-static int connect_server(struct client *ctx, const char *cmdline)
+static int write_all(int fd, const char *buf, size_t rem)
 {
-	const struct process *const p = ctx->p;
-	struct sockaddr *sa = (struct sockaddr *)&p->ssa;
-	int ret, wfd = -1;
+	ssize_t len;
 
-	wfd = socket(sa->sa_family, SOCK_STREAM, 0);
-	if (wfd == -1) {
-		perror("socket");
-		return -1;
-	}
-	ret = connect(wfd, sa, p->salen);
-	if (ret == -1) {
-		perror("connect");
-		goto err;
+	while (rem > 0) {
+		len = write(fd, buf, rem);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		rem -= len;
+		buf += len;
 	}
-	ctx->wfd = wfd;
 	return 0;
-err:
-	if (wfd != -1)
-		if (close(wfd))
-			perror("close");
-	return -1;
 }
 
 static ssize_t send_command(struct client *ctx, const char *cmdline)
 {
-	ssize_t rem;
-	char *buf;
+	const struct process *const p = ctx->p;
+	size_t len = strlen(cmdline);
+	struct frame f = {
+		.id	= htonl(ctx->next_id++),
+		.type	= htonl(FRAME_EXEC),
+		.len	= htonl(len),
+	};
+	struct iovec iov[2] = {
+		{.iov_base = &f,		.iov_len = sizeof(f)},
+		{.iov_base = (char *)cmdline,	.iov_len = len},
+	};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+	ssize_t ret;
 
-	rem = strlen(cmdline)+1; /* include null charater */
-	buf = (char *)cmdline;
-	while (rem > 0) {
-		ssize_t len = send(ctx->wfd, buf, rem, 0);
-		if (len == -1) {
-			perror("send");
+	while (msg.msg_iovlen) {
+		ret = sendmsg(p->sd, &msg, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("sendmsg");
 			return -1;
 		}
-		rem -= len;
-		buf += len;
+		while (msg.msg_iovlen && ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
 	}
-	return rem;
+	ctx->inflight++;
+	return 0;
 }
 
-static ssize_t handle_response(struct client *ctx)
+static int handle_frame(struct client *ctx, const struct frame *f,
+			const char *payload, size_t len)
+{
+	uint32_t code;
+
+	switch (ntohl(f->type)) {
+	case FRAME_STDOUT:
+		return write_all(STDOUT_FILENO, payload, len);
+	case FRAME_STDERR:
+		return write_all(STDERR_FILENO, payload, len);
+	case FRAME_EXIT:
+		if (len != sizeof(code))
+			break;
+		memcpy(&code, payload, sizeof(code));
+		code = ntohl(code);
+		if (code)
+			fprintf(stderr, "child exit with exit status(%u)\n", code);
+		ctx->inflight--;
+		return 0;
+	default:
+		break;
+	}
+	fprintf(stderr, "invalid frame(type=%u,len=%zu)\n", ntohl(f->type), len);
+	return -1;
+}
+
+/* handle the frames out of a single recv(2) */
+static int handle_response(struct client *ctx, int flags)
 {
 	const struct process *const p = ctx->p;
-	ssize_t rem, len;
-	char *buf;
+	struct frame f;
+	size_t flen;
+	ssize_t len;
 
-	len = recv(p->rfd, ctx->buf, sizeof(ctx->buf), 0);
+	len = recv(p->sd, ctx->rbuf+ctx->rlen, sizeof(ctx->rbuf)-ctx->rlen, flags);
 	if (len == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		perror("recv");
 		return -1;
+	} else if (len == 0) {
+		fprintf(stderr, "server closed the connection\n");
+		return -1;
 	}
-	buf = ctx->buf;
-	rem = len;
-	for (;;) {
-		len = write(STDOUT_FILENO, buf, rem);
-		if (len == -1) {
-			perror("write");
+	ctx->rlen += len;
+	while (ctx->rlen >= sizeof(f)) {
+		memcpy(&f, ctx->rbuf, sizeof(f));
+		flen = ntohl(f.len);
+		if (flen > FRAME_MAX) {
+			fprintf(stderr, "too large frame(%zu)\n", flen);
 			return -1;
 		}
-		rem -= len;
-		buf += len;
-		if (rem == 0)
+		if (ctx->rlen < sizeof(f)+flen)
 			break;
+		if (handle_frame(ctx, &f, ctx->rbuf+sizeof(f), flen) == -1)
+			return -1;
+		ctx->rlen -= sizeof(f)+flen;
+		memmove(ctx->rbuf, ctx->rbuf+sizeof(f)+flen, ctx->rlen);
 	}
 	return 0;
 }
 
-static int exec(struct client *ctx, const char *cmdline)
+/* returns 0 at the end of the commands */
+static int exec(struct client *ctx)
 {
-	ssize_t len;
-	int ret;
-
+	const char *cmdline;
 
+	/* show what is already there before blocking on the next line */
+	while (ctx->inflight && ctx->rlen < sizeof(ctx->rbuf)) {
+		unsigned rlen = ctx->rlen, inflight = ctx->inflight;
+		if (handle_response(ctx, MSG_DONTWAIT) == -1)
+			return -1;
+		if (ctx->rlen == rlen && ctx->inflight == inflight)
+			break;
+	}
+	cmdline = fetch(ctx);
+	if (cmdline == NULL)
+		return 0;
 	if (strlen(cmdline) == 0)
 		return 1;
 	else if (!strncasecmp(cmdline, "quit", strlen(cmdline)))
 		return 0;
-	ret = connect_server(ctx, cmdline);
-	if (ret == -1)
+	if (send_command(ctx, cmdline) == -1)
 		return -1;
-	len = send_command(ctx, cmdline);
-	if (len == -1)
-		goto out;
-	len = handle_response(ctx);
-	if (len == -1)
-		goto out;
-out:
-	if (ctx->wfd != -1)
-		if (shutdown(ctx->wfd, SHUT_RDWR))
-			perror("shutdown");
-	ctx->wfd = -1;
 	return 1;
 }
 
@@ -191,9 +265,25 @@ static int init_server(struct process *p)
 {
 	unsigned short port = p->port;
 	struct sockaddr_in *sin4;
+	struct sockaddr_un *sun;
 	char *addr, *colon;
 	int ret;
 
+	if (p->server[0] == '/' || p->server[0] == '@') {
+		sun = (struct sockaddr_un *)&p->ssa;
+		if (strlen(p->server) >= sizeof(sun->sun_path))
+			return -1;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, p->server);
+		p->salen = offsetof(struct sockaddr_un, sun_path)
+			   + strlen(p->server) + 1;
+		if (p->server[0] == '@') {
+			/* abstract namespace */
+			sun->sun_path[0] = '\0';
+			p->salen--;
+		}
+		return 0;
+	}
 	addr = strdup(p->server);
 	if (addr == NULL) {
 		perror("strdup");
@@ -215,42 +305,36 @@ static int init_server(struct process *p)
 		goto out;
 	}
 	ret = 0;
-	/* server side */
 	p->salen = sizeof(struct sockaddr_in);
 	sin4->sin_family = AF_INET;
 	sin4->sin_port = htons(port);
-	/* client side */
-	memcpy(&p->csa, &p->ssa, sizeof(p->csa));
-	sin4 = (struct sockaddr_in *)&p->csa;
-	sin4->sin_addr.s_addr = 0;
-	goto out;
 out:
 	if (addr)
 		free(addr);
 	return ret;
 }
 
-static int init_rfd(struct process *p)
+/* single connection for all the commands */
+static int connect_server(struct process *p)
 {
-	struct sockaddr *sa = (struct sockaddr *)&p->csa;
-	int ret, rfd = -1;
+	struct sockaddr *sa = (struct sockaddr *)&p->ssa;
+	int ret, sd;
 
-	rfd = socket(sa->sa_family, SOCK_DGRAM, 0);
-	if (rfd == -1) {
+	sd = socket(sa->sa_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sd == -1) {
 		perror("socket");
 		return -1;
 	}
-	ret = bind(rfd, sa, p->salen);
+	ret = connect(sd, sa, p->salen);
 	if (ret == -1) {
-		perror("bind");
+		perror("connect");
 		goto err;
 	}
-	p->rfd = rfd;
+	p->sd = sd;
 	return 0;
 err:
-	if (rfd != -1)
-		if (close(rfd))
-			perror("close");
+	if (close(sd))
+		perror("close");
 	return -1;
 }
 
@@ -262,7 +346,7 @@ static int init(struct process *p)
 	ret = init_server(p);
 	if (ret == -1)
 		return -1;
-	ret = init_rfd(p);
+	ret = connect_server(p);
 	if (ret == -1)
 		return -1;
 	c->p = p;
@@ -271,13 +355,8 @@ static int init(struct process *p)
 
 static void term(const struct process *restrict p)
 {
-	const struct client *ctx = p->client;
-
-	if (ctx->wfd != -1)
-		if (shutdown(ctx->wfd, SHUT_RDWR))
-			perror("shutdown");
-	if (p->rfd != -1)
-		if (close(p->rfd))
+	if (p->sd != -1)
+		if (close(p->sd))
 			perror("close");
 }
 
@@ -285,13 +364,19 @@ int main(int argc, char *const argv[])
 {
 	struct process *const p = &process;
 	struct client *ctx;
-	const char *cmd;
-	int o, ret;
+	int o, ret, done = 0;
 
 	p->progname = argv[0];
 	optind = 0;
 	while ((o = getopt_long(argc, argv, p->opts, p->lopts, NULL)) != -1) {
+		long val;
 		switch (o) {
+		case 'j':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > SHRT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->jobs = val;
+			break;
 		case 'h':
 			usage(p, stdout, EXIT_SUCCESS);
 			break;
@@ -307,9 +392,20 @@ int main(int argc, char *const argv[])
 	if (ret == -1)
 		return 1;
 	ctx = p->client;
-	while ((cmd = fetch(ctx)))
-		if ((ret = exec(ctx, cmd)) <= 0)
+	for (;;) {
+		/* keep up to -j commands in flight */
+		while (!done && ctx->inflight < p->jobs) {
+			if ((ret = exec(ctx)) == -1)
+				goto out;
+			done = !ret;
+		}
+		if (ctx->inflight == 0)
 			break;
+		if ((ret = handle_response(ctx, 0)) == -1)
+			goto out;
+	}
+	ret = 0;
+out:
 	term(p);
 	if (ret)
 		return 1;
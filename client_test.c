@@ -11,7 +11,7 @@ int main(void)
 	char *const target = realpath("./client", NULL);
 	const struct test {
 		const char	*const name;
-		char		*const argv[3];
+		char		*const argv[4];
 		int		want;
 	} *t, tests[] = {
 		{
@@ -19,6 +19,11 @@ int main(void)
 			.argv	= {target, "-h", NULL},
 			.want	= 0,
 		},
+		{
+			.name	= "zero jobs",
+			.argv	= {target, "-j", "0", NULL},
+			.want	= 1,
+		},
 		{.name = NULL}, /* sentry */
 	};
 	int ret = 0;
@@ -6,6 +6,7 @@ int main(void)
 {
 	const clockid_t clocks[] = {
 		CLOCK_REALTIME,
+		CLOCK_REALTIME_COARSE,
 		CLOCK_MONOTONIC,
 		CLOCK_MONOTONIC_RAW,
 		CLOCK_PROCESS_CPUTIME_ID,
@@ -1,29 +1,451 @@
 /* SPDX-License-Identifier: GPL-2.0 */
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
 #include <sched.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/sysinfo.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <poll.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
 
-/* server context */
+/* multishot accept and provided buffer rings came with v5.19 */
+#ifdef IORING_ACCEPT_MULTISHOT
+#define HAVE_URING
+#endif
+
+/* lookups confined to the document root, v5.6 */
+#if defined(RESOLVE_BENEATH) && defined(__NR_openat2)
+#define HAVE_OPENAT2
+#endif
+
+/* per epoll instance busy polling, v6.9 and glibc 2.40 */
+#ifdef EPIOCSPARAMS
+#define HAVE_EPOLL_PARAMS
+#endif
+
+/* precompressed response cache variants */
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define HAVE_ZLIB
+#endif
+#if __has_include(<brotli/encode.h>)
+#include <brotli/encode.h>
+#define HAVE_BROTLI
+#endif
+
+#define NR_EVENTS	64
+#define NR_HEADERS	32
+#define RBUF_SIZE	16384
+#define OBUF_SIZE	4096
+#define RESP_MAX	512	/* largest generated response */
+#define NR_FILES	64	/* open file cache entries per server */
+#define NR_FILE_HASH	128	/* open file cache hash buckets */
+#define FILE_PATH_MAX	256	/* longest cacheable path */
+#define FILE_VALID	1	/* open file revalidation period in sec */
+#define SENDFILE_MAX	(1<<20)	/* sendfile(2) chunk per call */
+#define URING_ENTRIES	1024	/* io_uring submission queue depth */
+#define NR_URING_BUFS	256	/* provided receive buffers, power of 2 */
+#define URING_BUF_SIZE	4096
+#define NR_LATENCY	32	/* log2 latency histogram buckets in usec */
+#define STATS_SIZE	65536	/* rendered /stats body */
+#define WHEEL_SLOTS	512	/* timer wheel slots, power of 2 */
+#define WHEEL_TICK	100	/* timer wheel tick in msec */
+#define SERVER_ALIGN	4096	/* first touch granularity of a server */
+#define NR_CACHE_HASH	1024	/* response cache hash buckets */
+#define CACHE_FILE_MAX	65536	/* largest cached file */
+#define CACHE_HEAD_MAX	384	/* prebuilt header block */
+#define CACHE_BROTLI	5	/* brotli quality, 11 is too slow on a miss */
+#define NR_IOV		4	/* response iovec, see conn_iov() */
+#define RELOAD_WAIT	10000	/* new process start up in msec */
+#define DRAIN_GRACE	1000	/* last keep-alive wait while draining */
+#define DATE_LEN	29	/* Sun, 06 Nov 1994 08:49:37 GMT */
+#define HTTP_DATE	"%a, %d %b %Y %H:%M:%S GMT"
+#define ETAG_MAX	56	/* "ino-size-mtime" in hex */
+#define RETRY_AFTER	"1"	/* seconds, on an overload 503 */
+#define NR_LISTENERS	8	/* --listen addresses */
+#define BUF_IDLE	1000	/* no buffer in use before trimming, in msec */
+#define LISTEN_MAX	256	/* longest --listen argument */
+
+/* what the connection is waiting for */
+enum wait {
+	WAIT_NONE = 0,
+	WAIT_HEADER,		/* the rest of the request header */
+	WAIT_KEEPALIVE,		/* the next request */
+	WAIT_IDLE,		/* the client to drain the response */
+};
+
+/* wall clock of a server, the Date header changes once a second */
+struct clock {
+	time_t			sec;
+	char			date[DATE_LEN+1];
+};
+
+/* file validators, out of its inode alone */
+struct validators {
+	char			etag[ETAG_MAX];
+	char			date[DATE_LEN+1];	/* Last-Modified */
+};
+
+/* timer wheel entry */
+struct timer {
+	struct timer		*prev;
+	struct timer		*next;
+	unsigned long		expire;		/* in ticks */
+};
+
+/*
+ * Hashed timer wheel, one per server.  A timer hangs off the slot of
+ * its expiry tick and the ticks are swept as the server loop comes
+ * around, so arming, disarming and expiring a timer are all O(1) and
+ * the only timeout the kernel sees is the one of the readiness wait.
+ */
+struct wheel {
+	unsigned long		now;		/* last swept tick */
+	unsigned		nr;
+	struct timer		slots[WHEEL_SLOTS];
+};
+
+enum engine {
+	ENGINE_EPOLL = 0,
+	ENGINE_URING,
+};
+
+/* what an overloaded server does to a new connection */
+enum overload {
+	OVERLOAD_REJECT = 0,	/* 503 and close */
+	OVERLOAD_PAUSE,		/* leave it in the accept queue */
+};
+
+static const char *const overloads[] = {"reject", "pause"};
+
+/* worker placement policy */
+enum placement {
+	PLACE_SPREAD = 0,	/* cores and nodes first, SMT siblings last */
+	PLACE_COMPACT,		/* SMT siblings and nodes filled in turn */
+	PLACE_CORE,		/* one worker per physical core */
+	PLACE_NUMA,		/* workers float within a NUMA node */
+};
+
+static const char *const placements[] = {
+	[PLACE_SPREAD]	= "spread",
+	[PLACE_COMPACT]	= "compact",
+	[PLACE_CORE]	= "core",
+	[PLACE_NUMA]	= "numa",
+};
+
+/* allowed CPU and its position in the topology */
+struct cpu {
+	int			cpu;
+	int			core;
+	int			package;
+	int			node;
+	int			thread;		/* SMT sibling index */
+	int			rank;		/* core index in the node */
+};
+
+/* response cache variants */
+enum encoding {
+	ENC_IDENTITY = 0,
+	ENC_GZIP,
+	ENC_BR,
+	NR_ENCODINGS,
+};
+
+/* prebuilt response in one encoding, header block without the Date */
+struct variant {
+	const char		*head;
+	size_t			hlen;
+	const char		*body;
+	size_t			blen;
+};
+
+/*
+ * Cached response, immutable once published.  Readers walk the hash
+ * chains without a lock, and a replaced or evicted entry is retired
+ * and freed only after every server has been outside of the cache
+ * since, see cache_reclaim().
+ */
+struct centry {
+	struct centry		*hnext;		/* atomic, hash chain */
+	struct centry		*next;		/* insertion order */
+	unsigned long		retired;	/* epoch it went away */
+	dev_t			dev;
+	ino_t			ino;
+	off_t			size;
+	struct timespec		mtime;
+	size_t			len;		/* accounted bytes */
+	struct variant		vars[NR_ENCODINGS];
+	size_t			plen;
+	char			path[FILE_PATH_MAX];
+	char			data[];		/* header blocks and bodies */
+};
+
+/* process wide response cache, writers serialized by the lock */
+struct cache {
+	pthread_mutex_t		lock;
+	unsigned long		epoch;		/* atomic */
+	size_t			size;
+	size_t			max;
+	struct centry		*head;		/* oldest, evicted first */
+	struct centry		*tail;
+	struct centry		*retired;
+	struct centry		*hash[NR_CACHE_HASH];	/* atomic */
+};
+
+/* zero-copy view into the connection receive buffer */
+struct str {
+	const char		*ptr;
+	size_t			len;
+};
+
+struct header {
+	struct str		name;
+	struct str		value;
+};
+
+/* parsed request, valid only until the receive buffer is compacted */
+struct request {
+	struct str		method;
+	struct str		uri;
+	int			minor;		/* HTTP/1.minor */
+	int			keepalive;
+	size_t			hlen;		/* request line and headers */
+	size_t			clen;		/* Content-Length */
+	unsigned		nr_headers;
+	struct header		headers[NR_HEADERS];
+};
+
+/* open file cache entry */
+struct file {
+	int			fd;
+	unsigned		refs;		/* connections sending it */
+	unsigned		hits;		/* repeat requests since opened */
+	time_t			checked;	/* last revalidation */
+	struct stat		st;
+	struct file		*hnext;
+	struct file		*prev;		/* LRU list */
+	struct file		*next;
+	size_t			plen;
+	char			path[FILE_PATH_MAX];
+};
+
+/* per server open file cache */
+struct files {
+	struct file		*lru;		/* most recently used */
+	struct file		*tail;		/* least recently used */
+	struct file		*hash[NR_FILE_HASH];
+	struct file		files[NR_FILES];
+};
+
+/* connection context */
+struct conn {
+	int			sd;
+	int			close;		/* close after the flush */
+	int			status;		/* last response status */
+	enum wait		wait;
+	struct timer		timer;
+	unsigned		nr_req;		/* requests served */
+	unsigned		nr_resp;	/* responses not flushed yet */
+	unsigned long		stamp;		/* request arrival in nsec */
+	size_t			rpos;		/* start of the current request */
+	size_t			rlen;		/* bytes in rbuf */
+	size_t			scan;		/* header terminator search offset */
+	size_t			skip;		/* request body bytes to discard */
+	size_t			opos;
+	size_t			olen;
+	size_t			hpos;		/* obuf offset of the head */
+	const char		*head;		/* cached header block */
+	size_t			hleft;
+	const char		*body;		/* server owned body, if any */
+	size_t			bleft;
+	char			*snap;		/* private /stats snapshot */
+	struct centry		*entry;		/* cached response, if any */
+	int			fd;		/* file to sendfile(2) */
+	off_t			foff;
+	size_t			fleft;
+	struct file		*file;		/* cached fd, if any */
+	unsigned		ops;		/* io_uring requests in flight */
+	struct msghdr		msg;		/* io_uring sendmsg */
+	struct iovec		iov[NR_IOV];
+	unsigned		reading:1;
+	unsigned		sending:1;
+	unsigned		polling:1;
+	unsigned		closing:1;
+	struct conn		*prev;
+	struct conn		*next;
+	char			*rbuf;		/* RBUF_SIZE, see get_buf() */
+	char			*obuf;		/* OBUF_SIZE */
+};
+
+/*
+ * Connection buffers, carved out of the per server buffer slab.  A
+ * connection holds one only while there is a request or a response in
+ * them, so that the idle keep-alive ones cost just their conn.
+ */
+struct buf {
+	char			rbuf[RBUF_SIZE];
+	char			obuf[OBUF_SIZE];
+};
+
+/*
+ * Fixed size object slab, preallocated and prefaulted by the server
+ * thread itself so that the request path neither calls malloc(3) nor
+ * takes a page fault.  Free objects are chained through their first
+ * word, and the ones never used are carved off the top on demand.  A
+ * slab which is not prefaulted only takes the pages of the objects in
+ * use at its peak, and gives them back once none is, see trim_slab().
+ */
+struct slab {
+	size_t			size;
+	unsigned		nr;
+	unsigned		used;
+	unsigned		top;		/* objects carved */
+	void			*free;
+	char			*mem;
+	size_t			len;
+};
+
+#ifdef HAVE_URING
+/* per server io_uring, driven without liburing */
+struct uring {
+	int			fd;
+	unsigned		tail;		/* local submission tail */
+	unsigned		sq_entries;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	void			*cq_ring;
+	size_t			sq_len;
+	size_t			cq_len;
+	size_t			sqes_len;
+	unsigned short		br_tail;
+	struct io_uring_buf_ring *br;
+	size_t			br_len;
+	char			*bufs;
+};
+#endif /* HAVE_URING */
+
+/*
+ * Per server counters.  Only the owner thread writes them, with relaxed
+ * atomic stores, so /stats can add them up from any thread without a
+ * lock; the alignment keeps every server on its own cache lines.
+ */
+struct stats {
+	unsigned long		conns;
+	unsigned long		accepts;
+	unsigned long		requests;
+	unsigned long		bytes_in;
+	unsigned long		bytes_out;
+	unsigned long		shed;		/* turned away on overload */
+	unsigned long		bufs;		/* connection buffers in use */
+	unsigned long		status[6];	/* by status class */
+	unsigned long		latency[NR_LATENCY];
+} __attribute__((aligned(64)));
+
+/*
+ * Listening address, with the servers accepting on it.  Every server
+ * has a socket of its own in the SO_REUSEPORT group of the address, so
+ * a listener dedicated to a few servers is never queued behind the
+ * connections of another one.
+ */
+struct listener {
+	int			domain;
+	short			backlog;	/* 0 for -b */
+	int			dedicated;	/* servers= given */
+	socklen_t		slen;
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	sin;
+		struct sockaddr_in6	sin6;
+		struct sockaddr_un	sun;
+	}			addr;
+	char			servers[SCHAR_MAX];	/* by server id */
+};
+
+/* a server socket of a listener, tagging its events */
+struct acceptor {
+	const struct listener	*l;
+	int			sd;
+	int			accepting;	/* io_uring accept armed */
+};
+
+/*
+ * Server context.  The main thread sets up the first page, the rest
+ * is first touched by the server once pinned, see init().
+ */
 struct server {
 	const struct process	*p;
 	pthread_t		tid;
-	int			status;
-	int			sd;
-	socklen_t		slen;
-	struct sockaddr		*ss;
-	struct sockaddr		*cs;
+	int			id;
+	int			cpu;
+	int			node;
+	int			evfd;		/* drain request */
+	struct acceptor		acceptors[NR_LISTENERS];	/* by listener */
+	int			status __attribute__((aligned(SERVER_ALIGN)));
+	int			efd;
+	int			draining;
+	int			paused;		/* not accepting, see admit_conn() */
+	unsigned long		lag;		/* atomic, loop pass in nsec, EWMA */
+	struct conn		*conns;
+	unsigned		nr_conns;
+	struct slab		conn_slab;
+	struct slab		buf_slab;
+	unsigned long		buf_idle;	/* tick the last buffer went back */
+	struct wheel		wheel;
+	struct clock		clock;
+	void			(*expire)(struct server *ctx, struct conn *c);
+	void			(*listen)(struct server *ctx, int on);
+	char			*sbuf;		/* rendered /stats */
+	unsigned		srefs;		/* connections sending it */
+	unsigned long		qepoch;		/* atomic, cache epoch in use */
+	unsigned		crefs;		/* connections on cached ones */
+	struct stats		stats;
+	struct request		req;
+	struct files		files;
+#ifdef HAVE_URING
+	struct uring		ring;
+#endif /* HAVE_URING */
+	struct epoll_event	events[NR_EVENTS];
+	char			path[PATH_MAX];
 };
 
 /* process wide variables */
@@ -31,26 +453,94 @@ static struct process {
 	const char		*progname;
 	short			backlog;
 	short			concurrent;
+	unsigned		max_conns;
+	unsigned		admit_conns;
+	int			max_lag;	/* in msec */
+	enum overload		overload;
 	int			domain;
 	short			port;
+	const char		*path;		/* AF_UNIX, @ for abstract */
+	int			nr_listeners;
+	struct listener		listeners[NR_LISTENERS];
 	int			timeout;
+	int			header_timeout;
+	int			keepalive_timeout;
+	int			idle_timeout;
+	const char		*root;
+	int			rootfd;
+	enum engine		engine;
+	enum placement		placement;
+	int			steer;
+	int			fastopen;	/* TCP_FASTOPEN queue */
+	int			defer_accept;	/* in seconds */
+	int			busy_poll;	/* in usec */
+	int			incoming_cpu;
+	size_t			cache_size;
+	struct cache		*cache;
+	int			inherit_fd;
+	int			argc;
+	char *const		*argv;
+	struct cpu		*cpus;
+	int			nr_cpus;
+	int			nr_nodes;
 	struct server		*servers;
 	const char		*const opts;
 	const struct option	lopts[];
 } proc = {
 	.backlog	= 5,
 	.concurrent	= 2,
+	.max_conns	= 1024,
+	.admit_conns	= 0,
+	.max_lag	= 0,
+	.overload	= OVERLOAD_REJECT,
 	.domain		= AF_INET,
 	.port		= 80,
+	.path		= NULL,
+	.nr_listeners	= 0,
 	.timeout	= 0,
-	.opts		= "46b:c:p:t:h",
+	.header_timeout		= 10000,
+	.keepalive_timeout	= 5000,
+	.idle_timeout		= 30000,
+	.root		= NULL,
+	.rootfd		= -1,
+	.engine		= ENGINE_EPOLL,
+	.placement	= PLACE_SPREAD,
+	.steer		= 0,
+	.fastopen	= 0,
+	.defer_accept	= 0,
+	.busy_poll	= 0,
+	.incoming_cpu	= 0,
+	.cache_size	= 16<<20,
+	.cache		= NULL,
+	.inherit_fd	= -1,
+	.cpus		= NULL,
+	.opts		= "46Aa:B:b:C:c:D:e:F:H:I:i:k:L:l:m:O:P:p:r:St:U:h",
 	.lopts		= {
 		{"ipv4",	no_argument,		0,	'4'},
 		{"ipv6",	no_argument,		0,	'6'},
+		{"incoming-cpu",	no_argument,		0,	'A'},
+		{"admit-conns",	required_argument,	0,	'a'},
+		{"busy-poll",	required_argument,	0,	'B'},
 		{"backlog",	required_argument,	0,	'b'},
+		{"cache-size",	required_argument,	0,	'C'},
 		{"concurrent",	required_argument,	0,	'c'},
+		{"defer-accept",	required_argument,	0,	'D'},
+		{"engine",	required_argument,	0,	'e'},
+		{"fastopen",	required_argument,	0,	'F'},
+		{"header-timeout",	required_argument,	0,	'H'},
+		{"inherit-fd",	required_argument,	0,	'I'},
+		{"idle-timeout",	required_argument,	0,	'i'},
+		{"keepalive-timeout",	required_argument,	0,	'k'},
+		{"max-lag",	required_argument,	0,	'L'},
+		{"listen",	required_argument,	0,	'l'},
+		{"max-conns",	required_argument,	0,	'm'},
+		{"overload",	required_argument,	0,	'O'},
+		{"placement",	required_argument,	0,	'P'},
 		{"port",	required_argument,	0,	'p'},
+		{"root",	required_argument,	0,	'r'},
+		{"steer",	no_argument,		0,	'S'},
 		{"timeout",	required_argument,	0,	't'},
+		{"unix",	required_argument,	0,	'U'},
 		{"help",	no_argument,		0,	'h'},
 		{NULL, 0, NULL, 0}, /* sentry */
 	},
@@ -70,22 +560,93 @@ static void usage(const struct process *restrict p, FILE *s, int status)
 		case '6':
 			fprintf(s, "\t\tListen only on IPv6\n");
 			break;
+		case 'A':
+			fprintf(s, "\tPrefer the listener of the server on the receiving CPU\n");
+			break;
+		case 'a':
+			fprintf(s, "\tConnections per server before overload (default: max-conns)\n");
+			break;
+		case 'B':
+			fprintf(s, "\t\tBusy poll the sockets for microseconds, 0 to disable (default: %d)\n"
+				"\t\tNeeds CAP_NET_ADMIN, httpd fails to start with EPERM otherwise\n",
+				p->busy_poll);
+			break;
 		case 'b':
 			fprintf(s, "\t\tListening backlog (default: %d)\n",
 				p->backlog);
 			break;
+		case 'C':
+			fprintf(s, "\tResponse cache size in bytes, 0 to disable (default: %zu)\n",
+				p->cache_size);
+			break;
 		case 'c':
 			fprintf(s, "\tNumber of concurrent server(s) (default: %d)\n",
 				p->concurrent);
 			break;
+		case 'D':
+			fprintf(s, "\tWake up on the request, not the handshake, up to seconds (default: %d)\n",
+				p->defer_accept);
+			break;
+		case 'F':
+			fprintf(s, "\t\tTCP Fast Open queue length, 0 to disable (default: %d)\n",
+				p->fastopen);
+			break;
+		case 'e':
+			fprintf(s, "\t\tEvent engine, epoll or uring (default: %s)\n",
+				p->engine == ENGINE_URING ? "uring" : "epoll");
+			break;
+		case 'H':
+			fprintf(s, "\tRequest header timeout in milliseconds (default: %d%s)\n",
+				p->header_timeout, p->header_timeout ? "" : ", infinite");
+			break;
+		case 'I':
+			fprintf(s, "\tReceive the listeners over this socket on reload\n");
+			break;
+		case 'i':
+			fprintf(s, "\tIdle timeout of a response in milliseconds (default: %d%s)\n",
+				p->idle_timeout, p->idle_timeout ? "" : ", infinite");
+			break;
+		case 'k':
+			fprintf(s, "\tKeep-alive timeout in milliseconds (default: %d%s)\n",
+				p->keepalive_timeout, p->keepalive_timeout ? "" : ", infinite");
+			break;
+		case 'L':
+			fprintf(s, "\t\tLoop lag in milliseconds before overload, 0 to disable (default: %d)\n",
+				p->max_lag);
+			break;
+		case 'l':
+			fprintf(s, "\t\tListen on ADDR:PORT, [ADDR6]:PORT or PATH[,backlog=N][,servers=FIRST[-LAST]], instead of -p or -U\n");
+			break;
+		case 'm':
+			fprintf(s, "\tMaximum connections per server (default: %u)\n",
+				p->max_conns);
+			break;
+		case 'O':
+			fprintf(s, "\t\tOn overload, reject or pause accepting (default: %s)\n",
+				overloads[p->overload]);
+			break;
+		case 'P':
+			fprintf(s, "\tWorker placement, spread, compact, core or numa (default: %s)\n",
+				placements[p->placement]);
+			break;
 		case 'p':
 			fprintf(s, "\t\tListen on the port (default: %d)\n",
 				p->port);
 			break;
+		case 'r':
+			fprintf(s, "\t\tDocument root directory (default: %s)\n",
+				p->root ? p->root : "none");
+			break;
+		case 'S':
+			fprintf(s, "\t\tSteer connections to the server on the CPU receiving them\n");
+			break;
 		case 't':
 			fprintf(s, "\t\tProcess timeout in milliseconds (default: %d%s)\n",
 				p->timeout, p->timeout > 0 ? "" : ", infinite");
 			break;
+		case 'U':
+			fprintf(s, "\t\tListen on the Unix domain socket path, @name for abstract\n");
+			break;
 		case 'h':
 			fprintf(s, "\t\tdisplay this message and exit\n");
 			break;
@@ -160,228 +721,3927 @@ static int init_timer(const struct process *restrict p)
 	return 0;
 }
 
-static int term_server(struct server *ctx);
+static unsigned hash_path(const char *path, size_t len)
+{
+	unsigned h = 2166136261u;
+	while (len--)
+		h = (h^(unsigned char)*path++)*16777619u;
+	return h;
+}
 
-static int init_server(struct server *ctx)
+static void unlink_lru(struct files *fs, struct file *f)
 {
-	const struct process *const p = ctx->p;
-	struct sockaddr_in *sin;
-	struct sockaddr_in6 *sin6;
-	socklen_t slen = 0;
-	int ret, opt, sd;
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		fs->lru = f->next;
+	if (f->next)
+		f->next->prev = f->prev;
+	else
+		fs->tail = f->prev;
+}
 
-	ctx->sd = -1;
-	switch (p->domain) {
-	case AF_INET:
-		slen = sizeof(struct sockaddr_in);
-		sin = calloc(2, slen);
-		if (sin == NULL) {
-			perror("calloc");
-			goto err;
-		}
-		sin[0].sin_family = sin[1].sin_family = AF_INET;
-		sin[0].sin_addr.s_addr = sin[1].sin_addr.s_addr = 0;
-		sin[0].sin_port = htons(p->port);
-		ctx->ss = (struct sockaddr *)&sin[0];
-		ctx->cs = (struct sockaddr *)&sin[1];
-		ctx->slen = slen;
-		break;
-	case AF_INET6:
-		slen = sizeof(struct sockaddr_in6);
-		sin6 = calloc(2, slen);
-		if (sin6 == NULL) {
-			perror("calloc");
-			goto err;
+static void link_lru(struct files *fs, struct file *f)
+{
+	f->prev = NULL;
+	f->next = fs->lru;
+	if (fs->lru)
+		fs->lru->prev = f;
+	else
+		fs->tail = f;
+	fs->lru = f;
+}
+
+static void init_files(struct files *fs)
+{
+	struct file *f;
+
+	memset(fs, 0, sizeof(*fs));
+	for (f = fs->files; f < fs->files+NR_FILES; f++) {
+		f->fd = -1;
+		link_lru(fs, f);
+	}
+}
+
+static void term_files(struct files *fs)
+{
+	struct file *f;
+
+	for (f = fs->files; f < fs->files+NR_FILES; f++)
+		if (f->fd != -1)
+			if (close(f->fd))
+				perror("close(file)");
+}
+
+/* drop the entry from the lookup, the fd goes with the last user */
+static void drop_file(struct files *fs, struct file *f)
+{
+	struct file **pp = &fs->hash[hash_path(f->path, f->plen)%NR_FILE_HASH];
+
+	for (; *pp; pp = &(*pp)->hnext)
+		if (*pp == f) {
+			*pp = f->hnext;
+			break;
 		}
-		sin6[0].sin6_family = sin6[1].sin6_family = AF_INET6;
-		memset(&sin6[0].sin6_addr, 0, sizeof(sin6->sin6_addr));
-		memset(&sin6[1].sin6_addr, 0, sizeof(sin6->sin6_addr));
-		sin6[0].sin6_port = sin6[1].sin6_port = htons(p->port);
-		ctx->ss = (struct sockaddr *)&sin6[0];
-		ctx->cs = (struct sockaddr *)&sin6[1];
-		ctx->slen = slen;
-		break;
-	default:
+	f->hnext = NULL;
+	f->plen = 0;
+	if (f->refs)
+		return;
+	if (close(f->fd))
+		perror("close(file)");
+	f->fd = -1;
+}
+
+/*
+ * Beneath the document root, symlinks included, where the kernel can
+ * tell.  decode_path() already keeps the path itself inside of it.
+ */
+static int open_file(const struct process *p, const char *path,
+		     struct stat *st)
+{
+#ifdef HAVE_OPENAT2
+	struct open_how how = {
+		.flags		= O_RDONLY|O_CLOEXEC|O_NONBLOCK,
+		.resolve	= RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS,
+	};
+#endif /* HAVE_OPENAT2 */
+	int ret, fd;
+
+#ifdef HAVE_OPENAT2
+	fd = syscall(__NR_openat2, p->rootfd, path, &how, sizeof(how));
+	if (fd == -1 && errno == ENOSYS)
+#endif /* HAVE_OPENAT2 */
+		fd = openat(p->rootfd, path, O_RDONLY|O_CLOEXEC|O_NONBLOCK);
+	if (fd == -1)
 		return -1;
-	}
-	sd = socket(p->domain, SOCK_STREAM, 0);
-	if (sd == -1) {
-		perror("socket");
-		ret = -1;
-		goto err;
-	}
-	ctx->sd = sd;
-	opt = 1;
-	ret = setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
-	if (ret == -1) {
-		perror("setsockopt(SO_REUSEPORT)");
-		goto err;
-	}
-	ret = bind(sd, ctx->ss, slen);
-	if (ret == -1) {
-		perror("bind");
+	ret = fstat(fd, st);
+	if (ret == -1)
 		goto err;
-	}
-	ret = listen(sd, p->backlog);
-	if (ret == -1) {
-		perror("listen");
+	if (!S_ISREG(st->st_mode)) {
+		errno = ENOENT;
 		goto err;
 	}
-	return 0;
+	return fd;
 err:
-	term_server(ctx);
-	return ret;
+	ret = errno;
+	if (close(fd))
+		perror("close");
+	errno = ret;
+	return -1;
 }
 
-static int term_server(struct server *ctx)
+static int same_file(const struct stat *a, const struct stat *b)
 {
-	int ret = 0;
-	if (ctx->sd != -1)
-		if (close(ctx->sd)) {
-			perror("close");
-			ret = -1;
-		}
-	if (ctx->ss)
-		free(ctx->ss);
-	return ret;
+	return a->st_ino == b->st_ino && a->st_dev == b->st_dev
+		&& a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec
+		&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
 }
 
-static void *server(void *arg)
+/*
+ * Look up the open file cache and fall back to open(2) on a miss.
+ * Entries are trusted for FILE_VALID seconds, after which a stat(2)
+ * catches a replaced or modified file.  Entries in use by an in flight
+ * sendfile(2) are never recycled; when all of them are busy the
+ * connection gets a private fd instead.
+ */
+static int get_file(struct server *ctx, struct conn *c, const char *path,
+		    size_t len, struct stat *st)
 {
-	struct server *ctx = arg;
-	socklen_t slen;
-	int ret;
+	struct files *fs = &ctx->files;
+	struct file *f = NULL;
+	unsigned h = 0;
+	time_t now;
+	int fd;
 
-	ctx->status = EXIT_FAILURE;
-	ret = init_server(ctx);
-	if (ret == -1)
-		return &ctx->status;
-	ret = accept(ctx->sd, ctx->cs, &slen);
-	if (ret == -1)
-		perror("accept");
-	else {
-		if (close(ret))
-			perror("close");
-		else
-			ctx->status = EXIT_SUCCESS;
+	if (len < FILE_PATH_MAX) {
+		h = hash_path(path, len)%NR_FILE_HASH;
+		for (f = fs->hash[h]; f; f = f->hnext)
+			if (f->plen == len && !memcmp(f->path, path, len))
+				break;
 	}
-	ret = term_server(ctx);
-	if (ret == -1)
-		ctx->status = EXIT_FAILURE;
-	return &ctx->status;
+	if (f != NULL) {
+		now = time(NULL);
+		if (now-f->checked < FILE_VALID)
+			goto hit;
+		if (fstatat(ctx->p->rootfd, path, st, 0) == 0
+		    && same_file(st, &f->st)) {
+			f->checked = now;
+			goto hit;
+		}
+		drop_file(fs, f);
+	}
+	fd = open_file(ctx->p, path, st);
+	if (fd == -1)
+		return -1;
+	c->fd = fd;
+	if (len >= FILE_PATH_MAX)
+		return 0;
+	/* recycle the least recently used idle entry */
+	for (f = fs->tail; f; f = f->prev)
+		if (f->refs == 0)
+			break;
+	if (f == NULL)
+		return 0; /* all busy, keep the private fd */
+	if (f->plen)
+		drop_file(fs, f);
+	else if (f->fd != -1) {
+		/* dropped while in use, the last user is gone now */
+		if (close(f->fd))
+			perror("close(file)");
+	}
+	f->fd = fd;
+	f->st = *st;
+	f->hits = 0;
+	f->checked = time(NULL);
+	f->plen = len;
+	memcpy(f->path, path, len+1);
+	f->hnext = fs->hash[h];
+	fs->hash[h] = f;
+	goto use;
+hit:
+	*st = f->st;
+use:
+	unlink_lru(fs, f);
+	link_lru(fs, f);
+	f->refs++;
+	c->fd = f->fd;
+	c->file = f;
+	return 0;
 }
 
-static int init(struct process *p)
+static void put_file(struct server *ctx, struct conn *c)
 {
-	struct server *s, *ss = NULL;
-	size_t size, nr = get_nprocs();
-	cpu_set_t *cpus;
-	int i, j, ret;
+	struct file *f = c->file;
 
-	cpus = CPU_ALLOC(nr);
-	if (cpus == NULL) {
-		perror("CPU_ALLOC");
-		return -1;
-	}
-	size = CPU_ALLOC_SIZE(nr);
-	ss = calloc(p->concurrent, sizeof(struct server));
-	if (ss == NULL) {
-		perror("calloc");
-		goto err;
+	if (c->fd == -1)
+		return;
+	if (f == NULL) {
+		if (close(c->fd))
+			perror("close(file)");
+	} else if (--f->refs == 0 && f->plen == 0) {
+		/* dropped while in use */
+		if (close(f->fd))
+			perror("close(file)");
+		f->fd = -1;
 	}
-	memset(ss, 0, p->concurrent*sizeof(struct server));
-	s = ss;
-	for (i = 0; i < p->concurrent; i++) {
-		s->p = p;
-		ret = pthread_create(&s->tid, NULL, server, s);
-		if (ret == -1)
-			goto err;
-		CPU_ZERO_S(size, cpus);
-		CPU_SET_S(i%nr, size, cpus);
-		ret = pthread_setaffinity_np(s->tid, size, cpus);
-		if (ret == -1)
-			goto err;
-		s++;
+	c->fd = -1;
+	c->file = NULL;
+	c->fleft = 0;
+}
+
+static int init_slab(struct slab *s, size_t size, unsigned nr, int populate)
+{
+	/* keep the objects cache line aligned */
+	size = (size+63)&~(size_t)63;
+	s->size = size;
+	s->nr = nr;
+	s->used = 0;
+	s->top = 0;
+	s->free = NULL;
+	s->len = size*nr;
+	s->mem = mmap(NULL, s->len, PROT_READ|PROT_WRITE,
+		      MAP_PRIVATE|MAP_ANONYMOUS|(populate ? MAP_POPULATE : 0),
+		      -1, 0);
+	if (s->mem == MAP_FAILED) {
+		perror("mmap(slab)");
+		s->mem = NULL;
+		return -1;
 	}
-	p->servers = ss;
-	ret = init_signal(p);
-	if (ret == -1)
-		goto err;
-	ret = init_timer(p);
-	if (ret == -1)
-		goto err;
-	CPU_FREE(cpus);
 	return 0;
-err:
-	if (ss != NULL) {
-		s = ss;
-		for (j = 0; j < i; j++) {
-			ret = pthread_cancel(s->tid);
-			if (ret) {
-				errno = ret;
-				perror("pthread_cancel");
-				/* ignore the error */
-			}
-			s++;
-		}
-		free(ss);
-	}
-	if (cpus != NULL)
-		CPU_FREE(cpus);
-	return ret;
 }
 
-static void term(const struct process *restrict p)
+static void term_slab(struct slab *s)
 {
-	struct server *s = p->servers;
-	int i, ret, *retp;
+	if (s->mem != NULL)
+		if (munmap(s->mem, s->len))
+			perror("munmap(slab)");
+	s->mem = s->free = NULL;
+}
 
-	if (s == NULL)
+/* the last one freed first, as it is the most likely in the cache */
+static void *slab_alloc(struct slab *s)
+{
+	void **obj = s->free;
+
+	if (obj != NULL)
+		s->free = *obj;
+	else if (s->top < s->nr)
+		obj = (void **)(s->mem+s->top++*s->size);
+	else
+		return NULL;
+	s->used++;
+	return obj;
+}
+
+static void slab_free(struct slab *s, void *ptr)
+{
+	void **obj = ptr;
+
+	*obj = s->free;
+	s->free = obj;
+	s->used--;
+}
+
+/* all the objects are free, give their pages back */
+static void trim_slab(struct slab *s)
+{
+	if (s->used || s->top == 0)
 		return;
-	for (i = 0; i < p->concurrent; i++) {
-		if (s->tid == 0)
-			continue;
-		ret = pthread_kill(s->tid, 0);
-		if (ret) {
-			perror("pthread_kill");
-			continue;
-		}
-		ret = pthread_join(s->tid, (void **)&retp);
-		if (ret) {
-			errno = ret;
-			perror("pthread_join");
-			/* ignore error */
-		}
-		if (*retp != EXIT_SUCCESS)
-			fprintf(stderr, "tid=%ld,status=%d\n", s->tid, *retp);
-		s++;
-	}
-	free(p->servers);
+	if (madvise(s->mem, s->top*s->size, MADV_DONTNEED))
+		perror("madvise(slab)");
+	s->top = 0;
+	s->free = NULL;
 }
 
-int main(int argc, char *const argv[])
+static unsigned long now_nsec(void)
 {
-	struct process *p = &proc;
-	int ret, opt;
+	struct timespec ts;
 
-	p->concurrent = get_nprocs();
-	p->progname = argv[0];
-	optind = 0;
-	while ((opt = getopt_long(argc, argv, p->opts, p->lopts, NULL)) != -1) {
-		long val;
-		switch (opt) {
-		case 'b':
-			val = strtol(optarg, NULL, 10);
-			if (val <= 0 || val > UCHAR_MAX)
-				usage(p, stderr, EXIT_FAILURE);
-			p->backlog = val;
-			break;
-		case 'c':
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000UL+ts.tv_nsec;
+}
+
+static void format_date(time_t sec, char *date)
+{
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	strftime(date, DATE_LEN+1, HTTP_DATE, &tm);
+}
+
+/*
+ * Called by the server loop on every wake up.  The coarse clock is a
+ * plain read of the last tick in the vDSO, and the formatting only
+ * happens when the second changes.
+ */
+static void update_clock(struct clock *clk)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (ts.tv_sec == clk->sec)
+		return;
+	clk->sec = ts.tv_sec;
+	format_date(ts.tv_sec, clk->date);
+}
+
+static void stat_add(unsigned long *counter, unsigned long val)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+val,
+			 __ATOMIC_RELAXED);
+}
+
+static unsigned long stat_read(const unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* bucket i counts the latencies below 2^i usec */
+static void stat_latency(struct stats *st, unsigned long nsec, unsigned nr)
+{
+	unsigned long usec = nsec/1000;
+	unsigned i = 0;
+
+	while (usec && i < NR_LATENCY-1) {
+		usec >>= 1;
+		i++;
+	}
+	stat_add(&st->latency[i], nr);
+}
+
+static unsigned long now_tick(void)
+{
+	return now_nsec()/(WHEEL_TICK*1000000UL);
+}
+
+static void init_wheel(struct wheel *w)
+{
+	struct timer *head;
+
+	w->now = now_tick();
+	w->nr = 0;
+	for (head = w->slots; head < w->slots+WHEEL_SLOTS; head++)
+		head->prev = head->next = head;
+}
+
+static void del_timer(struct wheel *w, struct timer *t)
+{
+	if (t->next == NULL)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+	w->nr--;
+}
+
+static void add_timer(struct wheel *w, struct timer *t, unsigned msec)
+{
+	struct timer *head;
+
+	del_timer(w, t);
+	/* round up, never fire early */
+	t->expire = now_tick()+(msec+WHEEL_TICK-1)/WHEEL_TICK+1;
+	if (t->expire <= w->now)
+		t->expire = w->now+1;
+	head = &w->slots[t->expire&(WHEEL_SLOTS-1)];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+	w->nr++;
+}
+
+/* msec until the next tick, for the readiness wait */
+static int wheel_timeout(const struct wheel *w)
+{
+	unsigned long now = now_nsec()/1000000UL;
+
+	if (w->nr == 0)
+		return -1;
+	return WHEEL_TICK-now%WHEEL_TICK;
+}
+
+static int term_server(struct server *ctx);
+
+/*
+ * Handshake and wake up tuning, on the listener as the accepted
+ * sockets inherit them.  An option not given is left alone, to keep
+ * what an inherited listener had.
+ */
+static int tune_listener(const struct server *ctx, const struct acceptor *a)
+{
+	const struct process *const p = ctx->p;
+	int ret, opt = 1;
+
+	/* TCP only options below, Unix domain listeners skip them */
+	if (a->l->domain == AF_UNIX)
+		return 0;
+	/* responses are batched with MSG_MORE, not by Nagle */
+	ret = setsockopt(a->sd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (ret == -1) {
+		perror("setsockopt(TCP_NODELAY)");
+		return -1;
+	}
+	if (p->fastopen) {
+		ret = setsockopt(a->sd, IPPROTO_TCP, TCP_FASTOPEN,
+				 &p->fastopen, sizeof(p->fastopen));
+		if (ret == -1) {
+			perror("setsockopt(TCP_FASTOPEN)");
+			return -1;
+		}
+	}
+	if (p->defer_accept) {
+		ret = setsockopt(a->sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				 &p->defer_accept, sizeof(p->defer_accept));
+		if (ret == -1) {
+			perror("setsockopt(TCP_DEFER_ACCEPT)");
+			return -1;
+		}
+	}
+	if (p->busy_poll) {
+		ret = setsockopt(a->sd, SOL_SOCKET, SO_BUSY_POLL,
+				 &p->busy_poll, sizeof(p->busy_poll));
+		if (ret == -1) {
+			perror("setsockopt(SO_BUSY_POLL)");
+			return -1;
+		}
+	}
+	/* the reuseport lookup scores the listener on this CPU higher */
+	if (p->incoming_cpu) {
+		opt = ctx->cpu;
+		ret = setsockopt(a->sd, SOL_SOCKET, SO_INCOMING_CPU, &opt,
+				 sizeof(opt));
+		if (ret == -1) {
+			perror("setsockopt(SO_INCOMING_CPU)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A socket file left behind by an earlier run is in the way of bind(2),
+ * but one with a server still behind it is not ours to remove.
+ */
+static int unlink_stale(const struct sockaddr *sa, socklen_t slen)
+{
+	const struct sockaddr_un *sun = (const struct sockaddr_un *)sa;
+	struct stat st;
+	int ret, sd;
+
+	if (sun->sun_path[0] == '\0')
+		return 0; /* abstract, gone with its last reference */
+	if (stat(sun->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+		return 0;
+	sd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
+		return -1;
+	}
+	ret = connect(sd, sa, slen);
+	close(sd);
+	if (ret == 0 || errno != ECONNREFUSED)
+		return 0; /* bind(2) tells */
+	ret = unlink(sun->sun_path);
+	if (ret == -1)
+		perror(sun->sun_path);
+	return ret;
+}
+
+/*
+ * Listeners are created by the main thread in the server order, as
+ * the order they join the SO_REUSEPORT group is the socket index the
+ * steering program returns.  On reload the listener handed over by
+ * the previous process, if any, is taken as is, so that the accept
+ * queue and the group membership carry over.
+ */
+static int init_listener(struct server *ctx, struct acceptor *a, int sd)
+{
+	const struct process *const p = ctx->p;
+	const struct listener *l = a->l;
+	socklen_t slen;
+	int i, ret, opt;
+
+	if (sd != -1) {
+		a->sd = sd;
+		slen = sizeof(opt);
+		ret = getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &opt, &slen);
+		if (ret == -1) {
+			perror("getsockopt(SO_ACCEPTCONN)");
+			return -1;
+		}
+		if (!opt) {
+			fprintf(stderr, "inherited socket is not listening\n");
+			return -1;
+		}
+		return tune_listener(ctx, a);
+	}
+	/*
+	 * No SO_REUSEPORT for AF_UNIX, the servers share the listener of
+	 * the first one instead, see init_epoll().
+	 */
+	for (i = 0; l->domain == AF_UNIX && i < ctx->id; i++) {
+		if (!l->servers[i])
+			continue;
+		sd = p->servers[i].acceptors[l-p->listeners].sd;
+		a->sd = fcntl(sd, F_DUPFD_CLOEXEC, 0);
+		if (a->sd == -1) {
+			perror("fcntl(F_DUPFD_CLOEXEC)");
+			return -1;
+		}
+		return 0;
+	}
+	if (l->domain == AF_UNIX && unlink_stale(&l->addr.sa, l->slen) == -1)
+		return -1;
+	sd = socket(l->domain, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
+		return -1;
+	}
+	a->sd = sd;
+	opt = 1;
+	ret = l->domain == AF_UNIX ? 0 : setsockopt(sd, SOL_SOCKET, SO_REUSEPORT,
+						     &opt, sizeof(opt));
+	if (ret == -1) {
+		perror("setsockopt(SO_REUSEPORT)");
+		return -1;
+	}
+	ret = bind(sd, &l->addr.sa, l->slen);
+	if (ret == -1) {
+		perror("bind");
+		return -1;
+	}
+	ret = listen(sd, l->backlog ? l->backlog : p->backlog);
+	if (ret == -1) {
+		perror("listen");
+		return -1;
+	}
+	return tune_listener(ctx, a);
+}
+
+static int init_server(struct server *ctx)
+{
+	const struct process *const p = ctx->p;
+	int ret;
+
+	ctx->efd = -1;
+	__atomic_store_n(&ctx->qepoch, ULONG_MAX, __ATOMIC_RELEASE);
+	init_files(&ctx->files);
+	init_wheel(&ctx->wheel);
+	update_clock(&ctx->clock);
+	ret = init_slab(&ctx->conn_slab, sizeof(struct conn), p->max_conns, 1);
+	if (ret == -1)
+		goto err;
+	/* taken on demand, and trimmed once unused, see get_buf() */
+	ret = init_slab(&ctx->buf_slab, sizeof(struct buf), p->max_conns, 0);
+	if (ret == -1)
+		goto err;
+	ctx->sbuf = malloc(STATS_SIZE);
+	if (ctx->sbuf == NULL) {
+		perror("malloc");
+		ret = -1;
+		goto err;
+	}
+	return 0;
+err:
+	term_server(ctx);
+	return ret;
+}
+
+static void close_conn(struct server *ctx, struct conn *c);
+
+static int term_server(struct server *ctx)
+{
+	int i, ret = 0;
+	while (ctx->conns)
+		close_conn(ctx, ctx->conns);
+	term_files(&ctx->files);
+	if (ctx->efd != -1)
+		if (close(ctx->efd)) {
+			perror("close(epoll)");
+			ret = -1;
+		}
+	for (i = 0; i < NR_LISTENERS; i++)
+		if (ctx->acceptors[i].sd != -1 && close(ctx->acceptors[i].sd)) {
+			perror("close");
+			ret = -1;
+		}
+	if (ctx->evfd != -1)
+		if (close(ctx->evfd)) {
+			perror("close(eventfd)");
+			ret = -1;
+		}
+	term_slab(&ctx->buf_slab);
+	term_slab(&ctx->conn_slab);
+	if (ctx->sbuf)
+		free(ctx->sbuf);
+	return ret;
+}
+
+/*
+ * The buffers of a connection, taken once there is something to read
+ * into them and given back as soon as a request is neither partially
+ * in nor its response partially out.  A response body is sent from
+ * the cache, the stats buffer or the file, so it does not need them.
+ */
+static int get_buf(struct server *ctx, struct conn *c)
+{
+	struct buf *b;
+
+	if (c->rbuf != NULL)
+		return 0;
+	b = slab_alloc(&ctx->buf_slab);
+	if (b == NULL)
+		return -1;
+	c->rbuf = b->rbuf;
+	c->obuf = b->obuf;
+	stat_add(&ctx->stats.bufs, 1);
+	return 0;
+}
+
+static void put_buf(struct server *ctx, struct conn *c)
+{
+	if (c->rbuf == NULL || c->rlen || c->olen)
+		return;
+	slab_free(&ctx->buf_slab, c->rbuf);
+	c->rbuf = c->obuf = NULL;
+	stat_add(&ctx->stats.bufs, -1);
+	if (ctx->buf_slab.used == 0)
+		ctx->buf_idle = now_tick();
+}
+
+/* once the server went without any buffer in use for a while */
+static void trim_bufs(struct server *ctx)
+{
+	if (ctx->buf_slab.used || ctx->buf_slab.top == 0)
+		return;
+	if (now_tick()-ctx->buf_idle >= BUF_IDLE/WHEEL_TICK)
+		trim_slab(&ctx->buf_slab);
+}
+
+static void put_body(struct server *ctx, struct conn *c);
+
+static void close_conn(struct server *ctx, struct conn *c)
+{
+	put_file(ctx, c);
+	put_body(ctx, c);
+	del_timer(&ctx->wheel, &c->timer);
+	/* close(2) drops the socket from the epoll set as well */
+	if (c->sd != -1)
+		if (close(c->sd))
+			perror("close");
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		ctx->conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	ctx->nr_conns--;
+	stat_add(&ctx->stats.conns, -1);
+	c->rlen = c->olen = 0;
+	put_buf(ctx, c);
+	slab_free(&ctx->conn_slab, c);
+}
+
+static struct conn *new_conn(struct server *ctx, int sd)
+{
+	struct conn *c;
+
+	/* full house, shed the connection */
+	c = slab_alloc(&ctx->conn_slab);
+	if (c == NULL)
+		goto err;
+	memset(c, 0, sizeof(*c));
+	c->sd = sd;
+	c->fd = -1;
+	c->next = ctx->conns;
+	if (c->next)
+		c->next->prev = c;
+	ctx->conns = c;
+	ctx->nr_conns++;
+	stat_add(&ctx->stats.conns, 1);
+	stat_add(&ctx->stats.accepts, 1);
+	return c;
+err:
+	return NULL;
+}
+
+/*
+ * The server is overloaded with too many connections in flight, or
+ * once a pass of its loop takes longer than the threshold, as that is
+ * how long a ready event waits for its turn.
+ */
+static int overloaded(const struct server *ctx)
+{
+	const struct process *p = ctx->p;
+
+	if (ctx->nr_conns >= p->admit_conns)
+		return 1;
+	return p->max_lag && ctx->lag > p->max_lag*1000000UL;
+}
+
+/* stop taking connections off the listener */
+static void pause_accept(struct server *ctx)
+{
+	if (ctx->paused)
+		return;
+	ctx->paused = 1;
+	ctx->listen(ctx, 0);
+}
+
+/*
+ * Turned away without any connection state.  A request already in
+ * is dropped first, as closing a socket with unread data resets the
+ * connection instead of delivering the 503.  A client gone already,
+ * or not done sending yet, just sees the connection close.
+ */
+static void reject_conn(struct server *ctx, int sd)
+{
+	static const char head[] = "HTTP/1.1 503 Service Unavailable\r\n"
+				   "Retry-After: " RETRY_AFTER "\r\n"
+				   "Content-Length: 0\r\n"
+				   "Date: ";
+	static const char tail[] = "\r\nConnection: close\r\n\r\n";
+	char buf[sizeof(head)+DATE_LEN+sizeof(tail)];
+	size_t len = sizeof(head)-1;
+
+	memcpy(buf, head, len);
+	memcpy(buf+len, ctx->clock.date, DATE_LEN);
+	len += DATE_LEN;
+	memcpy(buf+len, tail, sizeof(tail)-1);
+	len += sizeof(tail)-1;
+	if (send(sd, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT) == -1
+	    && errno != EAGAIN && errno != EWOULDBLOCK && errno != EPIPE
+	    && errno != ECONNRESET)
+		perror("send");
+	if (recv(sd, NULL, RBUF_SIZE, MSG_DONTWAIT|MSG_TRUNC) == -1
+	    && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNRESET)
+		perror("recv");
+	if (close(sd))
+		perror("close");
+	stat_add(&ctx->stats.shed, 1);
+	stat_add(&ctx->stats.status[5], 1);
+}
+
+/*
+ * Admission control of a connection just accepted.  Under overload it
+ * is either turned away, or let in while the accepts pause, leaving
+ * the rest in the listen queue until the load goes down, see
+ * update_load().  A full connection slab turns it away in any case.
+ */
+static struct conn *admit_conn(struct server *ctx, int sd)
+{
+	struct conn *c;
+
+	if (overloaded(ctx)) {
+		if (ctx->p->overload == OVERLOAD_REJECT)
+			goto reject;
+		pause_accept(ctx);
+	}
+	c = new_conn(ctx, sd);
+	if (c != NULL)
+		return c;
+reject:
+	reject_conn(ctx, sd);
+	return NULL;
+}
+
+/* end of a loop pass started at start */
+static void update_load(struct server *ctx, unsigned long start)
+{
+	long busy = now_nsec()-start;
+	long lag = ctx->lag;
+
+	__atomic_store_n(&ctx->lag, lag+(busy-lag)/8, __ATOMIC_RELAXED);
+	if (ctx->paused && !ctx->draining && !overloaded(ctx)) {
+		ctx->paused = 0;
+		ctx->listen(ctx, 1);
+	}
+}
+
+/* a paused server has to see the load going away */
+static int loop_timeout(const struct server *ctx)
+{
+	int msec = wheel_timeout(&ctx->wheel);
+
+	if (ctx->paused && !ctx->draining && (msec == -1 || msec > WHEEL_TICK))
+		msec = WHEEL_TICK;
+	/* and an idle one to trim its buffers */
+	if (ctx->buf_slab.top && !ctx->buf_slab.used
+	    && (msec == -1 || msec > WHEEL_TICK))
+		msec = WHEEL_TICK;
+	return msec;
+}
+
+static int str_eq(const struct str *s, const char *lit)
+{
+	size_t len = strlen(lit);
+	return s->len == len && !strncasecmp(s->ptr, lit, len);
+}
+
+/* case insensitive search of a token in a comma separated list */
+static int str_has_token(const struct str *s, const char *token)
+{
+	const char *ptr = s->ptr, *end = s->ptr+s->len;
+	struct str t;
+
+	while (ptr < end) {
+		while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == ','))
+			ptr++;
+		t.ptr = ptr;
+		while (ptr < end && *ptr != ',')
+			ptr++;
+		t.len = ptr-t.ptr;
+		while (t.len && (t.ptr[t.len-1] == ' ' || t.ptr[t.len-1] == '\t'))
+			t.len--;
+		if (str_eq(&t, token))
+			return 1;
+	}
+	return 0;
+}
+
+static const struct str *find_header(const struct request *r, const char *name)
+{
+	const struct header *h;
+	unsigned i;
+
+	for (i = 0, h = r->headers; i < r->nr_headers; i++, h++)
+		if (str_eq(&h->name, name))
+			return &h->value;
+	return NULL;
+}
+
+static const char *reason(int status)
+{
+	switch (status) {
+	case 200:
+		return "OK";
+	case 206:
+		return "Partial Content";
+	case 304:
+		return "Not Modified";
+	case 400:
+		return "Bad Request";
+	case 403:
+		return "Forbidden";
+	case 404:
+		return "Not Found";
+	case 413:
+		return "Payload Too Large";
+	case 416:
+		return "Range Not Satisfiable";
+	case 431:
+		return "Request Header Fields Too Large";
+	case 501:
+		return "Not Implemented";
+	case 503:
+		return "Service Unavailable";
+	case 505:
+		return "HTTP Version Not Supported";
+	default:
+		return "Internal Server Error";
+	}
+}
+
+/*
+ * Parse the request line and the header fields in place.  It returns
+ * the HTTP status code to reject the request with, 0 when the header
+ * block is not complete yet, or -1 when the request is ready to serve.
+ * c->scan remembers how far the header terminator search went so that
+ * a request trickling in is not rescanned from the start on every recv.
+ */
+static int parse_request(struct conn *c, struct request *r)
+{
+	const char *start = c->rbuf+c->rpos, *end, *ptr, *eol;
+	const struct str *v;
+	struct header *h;
+	size_t len = c->rlen-c->rpos;
+	char *term;
+
+	term = memmem(start+c->scan, len-c->scan, "\r\n\r\n", 4);
+	if (term == NULL) {
+		c->scan = len < 3 ? 0 : len-3;
+		return 0;
+	}
+	memset(r, 0, offsetof(struct request, headers));
+	r->hlen = term+4-start;
+	end = term+2;
+
+	/* request line */
+	eol = memchr(start, '\r', end-start);
+	r->method.ptr = ptr = start;
+	while (ptr < eol && *ptr != ' ')
+		ptr++;
+	r->method.len = ptr-r->method.ptr;
+	if (r->method.len == 0 || ptr == eol)
+		return 400;
+	r->uri.ptr = ++ptr;
+	while (ptr < eol && *ptr != ' ')
+		ptr++;
+	r->uri.len = ptr-r->uri.ptr;
+	if (r->uri.len == 0 || ptr == eol)
+		return 400;
+	ptr++;
+	if (eol-ptr != 8 || strncmp(ptr, "HTTP/1.", 7))
+		return strncmp(ptr, "HTTP/", 5) ? 400 : 505;
+	if (ptr[7] != '0' && ptr[7] != '1')
+		return 505;
+	r->minor = ptr[7]-'0';
+
+	/* header fields */
+	for (ptr = eol+2; ptr < end; ptr = eol+2) {
+		eol = memchr(ptr, '\r', end-ptr);
+		if (eol == NULL || eol[1] != '\n')
+			return 400;
+		if (r->nr_headers == NR_HEADERS)
+			return 431;
+		h = &r->headers[r->nr_headers++];
+		h->name.ptr = ptr;
+		while (ptr < eol && *ptr != ':')
+			ptr++;
+		h->name.len = ptr-h->name.ptr;
+		if (h->name.len == 0 || ptr == eol)
+			return 400;
+		ptr++;
+		while (ptr < eol && (*ptr == ' ' || *ptr == '\t'))
+			ptr++;
+		h->value.ptr = ptr;
+		h->value.len = eol-ptr;
+		while (h->value.len && (ptr[h->value.len-1] == ' '
+					|| ptr[h->value.len-1] == '\t'))
+			h->value.len--;
+	}
+
+	/* message semantics */
+	r->keepalive = r->minor > 0;
+	v = find_header(r, "Connection");
+	if (v != NULL) {
+		if (str_has_token(v, "close"))
+			r->keepalive = 0;
+		else if (str_has_token(v, "keep-alive"))
+			r->keepalive = 1;
+	}
+	if (r->minor > 0 && find_header(r, "Host") == NULL)
+		return 400;
+	if (find_header(r, "Transfer-Encoding") != NULL)
+		return 501;
+	v = find_header(r, "Content-Length");
+	if (v != NULL) {
+		size_t i;
+		if (v->len == 0 || v->len > 18)
+			return 400;
+		for (i = 0; i < v->len; i++) {
+			if (v->ptr[i] < '0' || v->ptr[i] > '9')
+				return 400;
+			r->clen = r->clen*10+v->ptr[i]-'0';
+		}
+	}
+	return -1;
+}
+
+/*
+ * The per response headers closing the header block, with the Date
+ * the server loop keeps formatted, see update_clock().
+ */
+static int respond_trailer(struct server *ctx, struct conn *c, int status,
+			   int keepalive)
+{
+	static const char ka[] = "\r\nConnection: keep-alive\r\n\r\n";
+	static const char cl[] = "\r\nConnection: close\r\n\r\n";
+	const char *tail = keepalive ? ka : cl;
+	size_t tlen = keepalive ? sizeof(ka)-1 : sizeof(cl)-1;
+	char *buf = c->obuf+c->olen;
+
+	if (OBUF_SIZE-c->olen < 6+DATE_LEN+tlen)
+		return -1;
+	memcpy(buf, "Date: ", 6);
+	memcpy(buf+6, ctx->clock.date, DATE_LEN);
+	memcpy(buf+6+DATE_LEN, tail, tlen);
+	c->olen += 6+DATE_LEN+tlen;
+	c->status = status;
+	if (!keepalive)
+		c->close = 1;
+	return 0;
+}
+
+static int respond_header(struct server *ctx, struct conn *c, int status,
+			  int keepalive, const char *type, size_t clen)
+{
+	int len;
+
+	len = snprintf(c->obuf+c->olen, OBUF_SIZE-c->olen,
+		       "HTTP/1.1 %d %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n",
+		       status, reason(status), type, clen);
+	if (len < 0 || len >= OBUF_SIZE-c->olen)
+		return -1;
+	c->olen += len;
+	return respond_trailer(ctx, c, status, keepalive);
+}
+
+/*
+ * Header of a file response, 200 or 206 with the body to sendfile(2)
+ * from off, or the bodyless 304 and 416.
+ */
+static int respond_file(struct server *ctx, struct conn *c, int status,
+			int keepalive, const char *type, const struct stat *st,
+			const struct validators *v, off_t off, off_t len)
+{
+	char *buf = c->obuf+c->olen;
+	size_t size = OBUF_SIZE-c->olen;
+	int n;
+
+	switch (status) {
+	case 304:
+		n = snprintf(buf, size,
+			     "HTTP/1.1 304 Not Modified\r\n"
+			     "ETag: %s\r\n"
+			     "Last-Modified: %s\r\n",
+			     v->etag, v->date);
+		break;
+	case 416:
+		n = snprintf(buf, size,
+			     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+			     "Content-Length: 0\r\n"
+			     "Content-Range: bytes */%lld\r\n",
+			     (long long)st->st_size);
+		break;
+	case 206:
+		n = snprintf(buf, size,
+			     "HTTP/1.1 206 Partial Content\r\n"
+			     "Content-Type: %s\r\n"
+			     "Content-Length: %lld\r\n"
+			     "Content-Range: bytes %lld-%lld/%lld\r\n"
+			     "ETag: %s\r\n"
+			     "Last-Modified: %s\r\n",
+			     type, (long long)len, (long long)off,
+			     (long long)(off+len-1), (long long)st->st_size,
+			     v->etag, v->date);
+		break;
+	default:
+		n = snprintf(buf, size,
+			     "HTTP/1.1 %d %s\r\n"
+			     "Content-Type: %s\r\n"
+			     "Content-Length: %lld\r\n"
+			     "ETag: %s\r\n"
+			     "Last-Modified: %s\r\n"
+			     "Accept-Ranges: bytes\r\n",
+			     status, reason(status), type, (long long)len,
+			     v->etag, v->date);
+		break;
+	}
+	if (n < 0 || n >= size)
+		return -1;
+	c->olen += n;
+	return respond_trailer(ctx, c, status, keepalive);
+}
+
+static int respond(struct server *ctx, struct conn *c, int status,
+		   int keepalive, int head, const char *type, const char *body)
+{
+	size_t blen = strlen(body);
+
+	if (respond_header(ctx, c, status, keepalive, type, blen))
+		return -1;
+	if (head)
+		return 0;
+	if (blen > OBUF_SIZE-c->olen)
+		return -1;
+	memcpy(c->obuf+c->olen, body, blen);
+	c->olen += blen;
+	return 0;
+}
+
+static int respond_error(struct server *ctx, struct conn *c, int status)
+{
+	char body[64];
+	snprintf(body, sizeof(body), "%d %s\n", status, reason(status));
+	return respond(ctx, c, status, 0, 0, "text/plain", body);
+}
+
+static const char *content_type(const char *path)
+{
+	static const struct {
+		const char	*ext;
+		const char	*type;
+	} *t, types[] = {
+		{"html",	"text/html"},
+		{"htm",		"text/html"},
+		{"css",		"text/css"},
+		{"js",		"application/javascript"},
+		{"json",	"application/json"},
+		{"txt",		"text/plain"},
+		{"png",		"image/png"},
+		{"jpg",		"image/jpeg"},
+		{"jpeg",	"image/jpeg"},
+		{"gif",		"image/gif"},
+		{"svg",		"image/svg+xml"},
+		{"ico",		"image/x-icon"},
+		{"mp4",		"video/mp4"},
+		{NULL,		NULL}, /* sentry */
+	};
+	const char *ext = strrchr(path, '.');
+
+	if (ext == NULL || strchr(ext, '/'))
+		return "application/octet-stream";
+	for (t = types, ext++; t->ext; t++)
+		if (!strcasecmp(ext, t->ext))
+			return t->type;
+	return "application/octet-stream";
+}
+
+/*
+ * The ETag changes with the inode, the size or the modification time,
+ * so neither a replaced nor a rewritten file keeps it.
+ */
+static void file_validators(const struct stat *st, struct validators *v)
+{
+	snprintf(v->etag, sizeof(v->etag), "\"%lx-%llx-%llx\"",
+		 (unsigned long)st->st_ino, (unsigned long long)st->st_size,
+		 (unsigned long long)st->st_mtim.tv_sec*1000000000ULL
+		 + st->st_mtim.tv_nsec);
+	format_date(st->st_mtim.tv_sec, v->date);
+}
+
+/* an If-None-Match list, with the weak comparison */
+static int etag_match(const struct str *s, const char *etag)
+{
+	const char *ptr = s->ptr, *end = s->ptr+s->len;
+	size_t len = strlen(etag);
+	struct str t;
+
+	while (ptr < end) {
+		while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == ','))
+			ptr++;
+		t.ptr = ptr;
+		while (ptr < end && *ptr != ',')
+			ptr++;
+		t.len = ptr-t.ptr;
+		while (t.len && (t.ptr[t.len-1] == ' ' || t.ptr[t.len-1] == '\t'))
+			t.len--;
+		if (t.len == 1 && *t.ptr == '*')
+			return 1;
+		if (t.len > 2 && !strncmp(t.ptr, "W/", 2)) {
+			t.ptr += 2;
+			t.len -= 2;
+		}
+		if (t.len == len && !memcmp(t.ptr, etag, len))
+			return 1;
+	}
+	return 0;
+}
+
+/* only the IMF-fixdate, as sent back from our Last-Modified */
+static int parse_date(const struct str *s, time_t *sec)
+{
+	char buf[DATE_LEN+1], *end;
+	struct tm tm;
+
+	if (s->len != DATE_LEN)
+		return -1;
+	memcpy(buf, s->ptr, DATE_LEN);
+	buf[DATE_LEN] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(buf, HTTP_DATE, &tm);
+	if (end == NULL || *end)
+		return -1;
+	*sec = timegm(&tm);
+	return 0;
+}
+
+/*
+ * The client copy is still good.  If-Modified-Since only counts
+ * without an If-None-Match, as in RFC 9110 13.2.2.
+ */
+static int is_fresh(const struct request *r, const struct stat *st,
+		    const struct validators *v)
+{
+	const struct str *s = find_header(r, "If-None-Match");
+	time_t sec;
+
+	if (s != NULL)
+		return etag_match(s, v->etag);
+	s = find_header(r, "If-Modified-Since");
+	return s != NULL && parse_date(s, &sec) == 0 && st->st_mtim.tv_sec <= sec;
+}
+
+static int parse_offset(const char **ptr, const char *end, off_t *val)
+{
+	const char *start = *ptr;
+
+	for (*val = 0; *ptr < end && **ptr >= '0' && **ptr <= '9'; (*ptr)++) {
+		if (*ptr-start == 18)
+			return -1;
+		*val = *val*10+**ptr-'0';
+	}
+	return *ptr == start ? -1 : 0;
+}
+
+/*
+ * A single byte range, the one a sendfile(2) can take.  It returns 1
+ * with the range, 0 for the whole file, which is what a malformed or a
+ * multiple range, or a stale If-Range gets, or -1 when it is not
+ * satisfiable.
+ */
+static int parse_range(const struct request *r, const struct validators *v,
+		       off_t size, off_t *off, off_t *len)
+{
+	const struct str *s = find_header(r, "Range"), *ir;
+	const char *ptr, *end;
+	off_t first = -1, last = -1;
+
+	if (s == NULL)
+		return 0;
+	/* a strong comparison, the date of a weak one is never exact */
+	ir = find_header(r, "If-Range");
+	if (ir != NULL && !(ir->len == strlen(v->etag)
+			    && !memcmp(ir->ptr, v->etag, ir->len))
+	    && !(ir->len == DATE_LEN && !memcmp(ir->ptr, v->date, DATE_LEN)))
+		return 0;
+	ptr = s->ptr;
+	end = s->ptr+s->len;
+	if (s->len < 6 || strncasecmp(ptr, "bytes=", 6)
+	    || memchr(ptr, ',', s->len))
+		return 0;
+	ptr += 6;
+	if (ptr < end && *ptr != '-' && parse_offset(&ptr, end, &first))
+		return 0;
+	if (ptr == end || *ptr++ != '-')
+		return 0;
+	if (ptr < end && parse_offset(&ptr, end, &last))
+		return 0;
+	if (ptr != end || (first == -1 && last == -1))
+		return 0;
+	if (first == -1) {
+		/* the suffix */
+		if (last == 0)
+			return -1;
+		first = size > last ? size-last : 0;
+		last = size-1;
+	} else if (last == -1 || last >= size)
+		last = size-1;
+	else if (last < first)
+		return 0;
+	if (first >= size)
+		return -1;
+	*off = first;
+	*len = last-first+1;
+	return 1;
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c-'0';
+	if (c >= 'a' && c <= 'f')
+		return c-'a'+10;
+	if (c >= 'A' && c <= 'F')
+		return c-'A'+10;
+	return -1;
+}
+
+/*
+ * Decode the request target into a path relative to the document root.
+ * It returns the path length, or -1 for the target outside of the root.
+ */
+static int decode_path(const struct str *uri, char *path, size_t size)
+{
+	const char *ptr = uri->ptr, *end = uri->ptr+uri->len;
+	size_t len = 0;
+	int hi, lo;
+	char ch;
+
+	if (ptr == end || *ptr != '/')
+		return -1;
+	for (ptr++; ptr < end && *ptr != '?' && *ptr != '#'; ptr++) {
+		ch = *ptr;
+		if (ch == '%') {
+			if (end-ptr < 3)
+				return -1;
+			hi = hexval(ptr[1]);
+			lo = hexval(ptr[2]);
+			if (hi == -1 || lo == -1)
+				return -1;
+			ch = hi<<4|lo;
+			ptr += 2;
+			/* an encoded separator is not one */
+			if (ch == '/')
+				return -1;
+		}
+		if (ch == '\0' || len+1 >= size)
+			return -1;
+		path[len++] = ch;
+	}
+	/* directory index */
+	if (len == 0 || path[len-1] == '/') {
+		if (len+sizeof("index.html") > size)
+			return -1;
+		memcpy(path+len, "index.html", sizeof("index.html"));
+		len += sizeof("index.html")-1;
+	}
+	path[len] = '\0';
+	/* no way out of the document root, nor an absolute path */
+	if (path[0] == '/' || !strcmp(path, "..") || !strncmp(path, "../", 3)
+	    || strstr(path, "/../") || (len > 2 && !strcmp(path+len-3, "/..")))
+		return -1;
+	return len;
+}
+
+/*
+ * Process wide response cache of small files.  A server is inside of
+ * the cache from a lookup until its last connection on a cached
+ * response is done, and it publishes the epoch it entered with in
+ * qepoch.  Lookups and hits take no lock, and the writer frees the
+ * entries retired before every server's epoch.
+ */
+static void cache_enter(struct server *ctx, struct cache *cache)
+{
+	if (ctx->crefs)
+		return;
+	__atomic_store_n(&ctx->qepoch,
+			 __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	/* published before the hash chains are read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void cache_leave(struct server *ctx)
+{
+	if (ctx->crefs == 0)
+		__atomic_store_n(&ctx->qepoch, ULONG_MAX, __ATOMIC_RELEASE);
+}
+
+static void cache_release(struct server *ctx)
+{
+	ctx->crefs--;
+	cache_leave(ctx);
+}
+
+static int cache_match(const struct centry *e, const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino
+		&& e->size == st->st_size
+		&& e->mtime.tv_sec == st->st_mtim.tv_sec
+		&& e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* takes a reference on the server for the cached response, if fresh */
+static struct centry *cache_get(struct server *ctx, const char *path,
+				size_t len, const struct stat *st)
+{
+	struct cache *cache = ctx->p->cache;
+	struct centry *e;
+	unsigned h;
+
+	if (cache == NULL || len >= FILE_PATH_MAX)
+		return NULL;
+	h = hash_path(path, len)%NR_CACHE_HASH;
+	cache_enter(ctx, cache);
+	for (e = __atomic_load_n(&cache->hash[h], __ATOMIC_ACQUIRE); e;
+	     e = __atomic_load_n(&e->hnext, __ATOMIC_ACQUIRE))
+		if (e->plen == len && !memcmp(e->path, path, len))
+			break;
+	if (e != NULL && cache_match(e, st)) {
+		ctx->crefs++;
+		return e;
+	}
+	cache_leave(ctx);
+	return NULL;
+}
+
+static void cache_reclaim(const struct process *p, struct cache *cache)
+{
+	unsigned long epoch, min = ULONG_MAX;
+	struct centry *e, **pp;
+	int i;
+
+	/* after the unlink, before the epochs in use */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < p->concurrent; i++) {
+		epoch = __atomic_load_n(&p->servers[i].qepoch, __ATOMIC_ACQUIRE);
+		if (epoch < min)
+			min = epoch;
+	}
+	for (pp = &cache->retired; (e = *pp) != NULL;) {
+		if (e->retired < min) {
+			*pp = e->next;
+			free(e);
+		} else
+			pp = &e->next;
+	}
+}
+
+/* unlinks the entry, called with the lock held */
+static void cache_retire(struct cache *cache, struct centry *e)
+{
+	struct centry **pp, *prev;
+	unsigned h = hash_path(e->path, e->plen)%NR_CACHE_HASH;
+
+	for (pp = &cache->hash[h]; *pp != e; pp = &(*pp)->hnext)
+		;
+	/* readers on it still find the rest of the chain */
+	__atomic_store_n(pp, e->hnext, __ATOMIC_RELEASE);
+	for (pp = &cache->head, prev = NULL; *pp != e; pp = &(*pp)->next)
+		prev = *pp;
+	*pp = e->next;
+	if (cache->tail == e)
+		cache->tail = prev;
+	cache->size -= e->len;
+	e->retired = __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED);
+	e->next = cache->retired;
+	cache->retired = e;
+}
+
+static size_t compress_gzip(const char *src, size_t len, char *dst,
+			    size_t size)
+{
+#ifdef HAVE_ZLIB
+	z_stream zs;
+	size_t n = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 for the gzip wrapper */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)dst;
+	zs.avail_out = size;
+	if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+		n = zs.total_out;
+	deflateEnd(&zs);
+	return n;
+#else
+	return 0;
+#endif /* HAVE_ZLIB */
+}
+
+static size_t compress_br(const char *src, size_t len, char *dst,
+			  size_t size)
+{
+#ifdef HAVE_BROTLI
+	if (BrotliEncoderCompress(CACHE_BROTLI, BROTLI_DEFAULT_WINDOW,
+				  BROTLI_MODE_GENERIC, len,
+				  (const uint8_t *)src, &size,
+				  (uint8_t *)dst) == BROTLI_TRUE)
+		return size;
+#endif /* HAVE_BROTLI */
+	return 0;
+}
+
+/*
+ * Reads in the file and builds the identity and the compressed
+ * variants outside of the lock, as a miss is already the slow path.
+ * A compressed variant is kept only when it saves an eighth.
+ */
+static struct centry *cache_build(const char *path, size_t plen, int fd,
+				  const struct stat *st)
+{
+	static const char *const codings[NR_ENCODINGS] = {
+		[ENC_GZIP]	= "gzip",
+		[ENC_BR]	= "br",
+	};
+	char head[NR_ENCODINGS][CACHE_HEAD_MAX], *src, *dst, *ptr;
+	size_t size = st->st_size, hlen[NR_ENCODINGS], blen[NR_ENCODINGS];
+	struct validators v;
+	size_t len = 0, n;
+	struct centry *e = NULL;
+	ssize_t ret;
+	int i;
+
+	src = malloc(size ? 3*size+1024 : 1);
+	if (src == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	while (len < size) {
+		ret = pread(fd, src+len, size-len, len);
+		if (ret <= 0)
+			goto out;
+		len += ret;
+	}
+	/* room for the compressed ones right after the file */
+	dst = src+size;
+	blen[ENC_IDENTITY] = size;
+	blen[ENC_GZIP] = compress_gzip(src, size, dst, size+512);
+	blen[ENC_BR] = compress_br(src, size, dst+size+512, size+512);
+	for (i = ENC_GZIP, n = 0; i < NR_ENCODINGS; i++) {
+		if (blen[i] > size-size/8)
+			blen[i] = 0;
+		n += blen[i];
+	}
+	file_validators(st, &v);
+	for (i = ENC_IDENTITY; i < NR_ENCODINGS; i++) {
+		hlen[i] = 0;
+		if (i != ENC_IDENTITY && blen[i] == 0)
+			continue;
+		/* the same weak ETag for the same content, encoded */
+		ret = snprintf(head[i], CACHE_HEAD_MAX,
+			       "HTTP/1.1 200 OK\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Length: %zu\r\n"
+			       "%s%s%s"
+			       "%s"
+			       "ETag: %s%s\r\n"
+			       "Last-Modified: %s\r\n"
+			       "Accept-Ranges: bytes\r\n",
+			       content_type(path), blen[i],
+			       codings[i] ? "Content-Encoding: " : "",
+			       codings[i] ? codings[i] : "",
+			       codings[i] ? "\r\n" : "",
+			       n ? "Vary: Accept-Encoding\r\n" : "",
+			       codings[i] ? "W/" : "", v.etag, v.date);
+		if (ret < 0 || ret >= CACHE_HEAD_MAX)
+			goto out;
+		hlen[i] = ret;
+		n += ret;
+	}
+	e = malloc(sizeof(struct centry)+size+n);
+	if (e == NULL) {
+		perror("malloc");
+		goto out;
+	}
+	memset(e, 0, sizeof(struct centry));
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->len = sizeof(struct centry)+size+n;
+	e->plen = plen;
+	memcpy(e->path, path, plen);
+	ptr = e->data;
+	for (i = ENC_IDENTITY; i < NR_ENCODINGS; i++) {
+		if (hlen[i] == 0)
+			continue;
+		memcpy(ptr, head[i], hlen[i]);
+		e->vars[i].head = ptr;
+		e->vars[i].hlen = hlen[i];
+		ptr += hlen[i];
+		memcpy(ptr, i == ENC_IDENTITY ? src : i == ENC_GZIP ? dst
+		       : dst+size+512, blen[i]);
+		e->vars[i].body = ptr;
+		e->vars[i].blen = blen[i];
+		ptr += blen[i];
+	}
+out:
+	free(src);
+	return e;
+}
+
+/* inserts the file, evicting the oldest ones to make room */
+static void cache_add(struct server *ctx, const char *path, size_t len,
+		      int fd, const struct stat *st)
+{
+	const struct process *const p = ctx->p;
+	struct cache *cache = p->cache;
+	struct centry *e, *old;
+	unsigned h;
+
+	if (cache == NULL || len >= FILE_PATH_MAX
+	    || st->st_size > CACHE_FILE_MAX
+	    || sizeof(struct centry)+st->st_size > cache->max)
+		return;
+	e = cache_build(path, len, fd, st);
+	if (e == NULL)
+		return;
+	if (e->len > cache->max) {
+		free(e);
+		return;
+	}
+	h = hash_path(path, len)%NR_CACHE_HASH;
+	pthread_mutex_lock(&cache->lock);
+	for (old = cache->hash[h]; old; old = old->hnext)
+		if (old->plen == len && !memcmp(old->path, path, len))
+			break;
+	if (old != NULL && cache_match(old, st)) {
+		/* the other server was faster */
+		pthread_mutex_unlock(&cache->lock);
+		free(e);
+		return;
+	}
+	if (old != NULL)
+		cache_retire(cache, old);
+	while (cache->size+e->len > cache->max)
+		cache_retire(cache, cache->head);
+	cache->size += e->len;
+	if (cache->tail)
+		cache->tail->next = e;
+	else
+		cache->head = e;
+	cache->tail = e;
+	e->hnext = cache->hash[h];
+	__atomic_store_n(&cache->hash[h], e, __ATOMIC_RELEASE);
+	if (cache->retired) {
+		__atomic_add_fetch(&cache->epoch, 1, __ATOMIC_SEQ_CST);
+		cache_reclaim(p, cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static struct cache *init_cache(size_t max)
+{
+	struct cache *cache;
+	int ret;
+
+	cache = calloc(1, sizeof(struct cache));
+	if (cache == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	ret = pthread_mutex_init(&cache->lock, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_mutex_init");
+		free(cache);
+		return NULL;
+	}
+	cache->max = max;
+	return cache;
+}
+
+static void term_cache(struct cache *cache)
+{
+	struct centry *e;
+
+	if (cache == NULL)
+		return;
+	while ((e = cache->head) != NULL) {
+		cache->head = e->next;
+		free(e);
+	}
+	while ((e = cache->retired) != NULL) {
+		cache->retired = e->next;
+		free(e);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/* a coding in Accept-Encoding, but not with q=0 */
+static int accepts(const struct str *s, const char *coding)
+{
+	const char *ptr = s->ptr, *end = s->ptr+s->len, *tok;
+	size_t len = strlen(coding);
+
+	while (ptr < end) {
+		while (ptr < end && (*ptr == ' ' || *ptr == ','))
+			ptr++;
+		tok = ptr;
+		while (ptr < end && *ptr != ',')
+			ptr++;
+		if (ptr-tok < len || strncasecmp(tok, coding, len)
+		    || (tok+len < ptr && !strchr(" \t;", tok[len])))
+			continue;
+		for (tok += len; tok < ptr && *tok != '='; tok++)
+			;
+		if (tok == ptr)
+			return 1;
+		/* q=0, q=0.000 and the like refuse it */
+		for (tok++; tok < ptr && (*tok == '0' || *tok == '.'); tok++)
+			;
+		return tok < ptr && *tok >= '1' && *tok <= '9';
+	}
+	return 0;
+}
+
+/*
+ * The cached header block goes out between the pipelined responses
+ * already in the output buffer and the Date and Connection headers
+ * appended here, see conn_iov().
+ */
+static int respond_cached(struct server *ctx, struct conn *c,
+			  const struct request *r, int head, struct centry *e)
+{
+	const struct str *ae = find_header(r, "Accept-Encoding");
+	const struct variant *v = &e->vars[ENC_IDENTITY];
+
+	if (ae && e->vars[ENC_BR].head && accepts(ae, "br"))
+		v = &e->vars[ENC_BR];
+	else if (ae && e->vars[ENC_GZIP].head && accepts(ae, "gzip"))
+		v = &e->vars[ENC_GZIP];
+	c->hpos = c->olen;
+	if (respond_trailer(ctx, c, 200, r->keepalive)) {
+		cache_release(ctx);
+		return -1;
+	}
+	c->entry = e;
+	c->head = v->head;
+	c->hleft = v->hlen;
+	if (head)
+		return 0;
+	c->body = v->body;
+	c->bleft = v->blen;
+	return 0;
+}
+
+static int serve_file(struct server *ctx, struct conn *c,
+		      const struct request *r, int head)
+{
+	struct validators v;
+	struct centry *e;
+	struct stat st;
+	off_t off = 0, size;
+	int len, ret = 0, cond;
+
+	len = decode_path(&r->uri, ctx->path, sizeof(ctx->path));
+	if (len == -1)
+		return respond_error(ctx, c, 404);
+	if (get_file(ctx, c, ctx->path, len, &st) == -1) {
+		switch (errno) {
+		case ENOENT:
+		case ENOTDIR:
+		case ENAMETOOLONG:
+		case ELOOP:
+		case EXDEV:	/* out of the root, see open_file() */
+			return respond(ctx, c, 404, r->keepalive, head, "text/plain",
+				       "404 Not Found\n");
+		case EACCES:
+			return respond(ctx, c, 403, r->keepalive, head, "text/plain",
+				       "403 Forbidden\n");
+		default:
+			perror(ctx->path);
+			return respond_error(ctx, c, 500);
+		}
+	}
+	/*
+	 * Conditional and range requests are answered out of the inode,
+	 * before the file or the cache are read at all.  The validators
+	 * are in the cached header block otherwise.
+	 */
+	size = st.st_size;
+	cond = find_header(r, "If-None-Match") != NULL
+	       || find_header(r, "If-Modified-Since") != NULL
+	       || (!head && find_header(r, "Range") != NULL);
+	if (cond) {
+		file_validators(&st, &v);
+		if (is_fresh(r, &st, &v)) {
+			put_file(ctx, c);
+			return respond_file(ctx, c, 304, r->keepalive, NULL,
+					    &st, &v, 0, 0);
+		}
+		ret = head ? 0 : parse_range(r, &v, st.st_size, &off, &size);
+		if (ret == -1) {
+			put_file(ctx, c);
+			return respond_file(ctx, c, 416, r->keepalive, NULL,
+					    &st, &v, 0, 0);
+		}
+	}
+	/*
+	 * The open file cache revalidated it against the cached one, and
+	 * tells it's hot when it's asked for again.  A range goes out of
+	 * the file.
+	 */
+	e = ret ? NULL : cache_get(ctx, ctx->path, len, &st);
+	if (e == NULL && !ret && c->file && c->file->hits++) {
+		cache_add(ctx, ctx->path, len, c->fd, &st);
+		e = cache_get(ctx, ctx->path, len, &st);
+	}
+	if (e != NULL) {
+		put_file(ctx, c);
+		return respond_cached(ctx, c, r, head, e);
+	}
+	if (!cond)
+		file_validators(&st, &v);
+	if (respond_file(ctx, c, ret ? 206 : 200, r->keepalive,
+			 content_type(ctx->path), &st, &v, off, size)) {
+		put_file(ctx, c);
+		return -1;
+	}
+	if (head || size == 0) {
+		put_file(ctx, c);
+		return 0;
+	}
+	c->foff = off;
+	c->fleft = size;
+	return 0;
+}
+
+static void put_body(struct server *ctx, struct conn *c)
+{
+	if (c->entry != NULL) {
+		c->entry = NULL;
+		c->head = NULL;
+		c->hleft = 0;
+		cache_release(ctx);
+	} else if (c->snap != NULL) {
+		free(c->snap);
+		c->snap = NULL;
+	} else if (c->body != NULL)
+		ctx->srefs--;
+	c->body = NULL;
+	c->bleft = 0;
+}
+
+/* sum of all the servers' counters, without any lock */
+static void sum_stats(const struct process *p, struct stats *sum)
+{
+	const unsigned long *src, *end;
+	unsigned long *dst;
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < p->concurrent; i++) {
+		src = (const unsigned long *)&p->servers[i].stats;
+		end = src+sizeof(*sum)/sizeof(unsigned long);
+		for (dst = (unsigned long *)sum; src < end; src++, dst++)
+			*dst += stat_read(src);
+	}
+}
+
+static int render_text(const struct process *p, char *buf, size_t size)
+{
+	const struct stats *st;
+	struct stats sum;
+	size_t len = 0;
+	int i;
+
+#define PRINT(...)							\
+	do {								\
+		int ret = snprintf(buf+len, size-len, __VA_ARGS__);	\
+		if (ret < 0 || ret >= size-len)				\
+			return -1;					\
+		len += ret;						\
+	} while (0)
+
+	sum_stats(p, &sum);
+	PRINT("servers: %d\n", p->concurrent);
+	PRINT("conns: %lu\naccepts: %lu\nrequests: %lu\n",
+	      sum.conns, sum.accepts, sum.requests);
+	PRINT("bytes_in: %lu\nbytes_out: %lu\n", sum.bytes_in, sum.bytes_out);
+	PRINT("shed: %lu\nbufs: %lu\n", sum.shed, sum.bufs);
+	PRINT("2xx: %lu\n3xx: %lu\n4xx: %lu\n5xx: %lu\n", sum.status[2],
+	      sum.status[3], sum.status[4], sum.status[5]);
+	PRINT("latency_usec:\n");
+	for (i = 0; i < NR_LATENCY; i++)
+		if (sum.latency[i])
+			PRINT("\t<%lu: %lu\n", 1UL<<i, sum.latency[i]);
+	for (i = 0; i < p->concurrent; i++) {
+		st = &p->servers[i].stats;
+		PRINT("server%d: cpu=%d node=%d conns=%lu accepts=%lu requests=%lu "
+		      "bytes_in=%lu bytes_out=%lu 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu "
+		      "shed=%lu bufs=%lu lag_usec=%lu\n",
+		      i, p->servers[i].cpu, p->servers[i].node,
+		      stat_read(&st->conns),
+		      stat_read(&st->accepts), stat_read(&st->requests),
+		      stat_read(&st->bytes_in), stat_read(&st->bytes_out),
+		      stat_read(&st->status[2]), stat_read(&st->status[3]),
+		      stat_read(&st->status[4]), stat_read(&st->status[5]),
+		      stat_read(&st->shed), stat_read(&st->bufs),
+		      stat_read(&p->servers[i].lag)/1000);
+	}
+	return len;
+}
+
+static int render_json(const struct process *p, char *buf, size_t size)
+{
+	const struct stats *st;
+	struct stats sum;
+	size_t len = 0;
+	int i, n;
+
+	sum_stats(p, &sum);
+	PRINT("{\"conns\":%lu,\"accepts\":%lu,\"requests\":%lu,",
+	      sum.conns, sum.accepts, sum.requests);
+	PRINT("\"bytes_in\":%lu,\"bytes_out\":%lu,", sum.bytes_in, sum.bytes_out);
+	PRINT("\"shed\":%lu,\"bufs\":%lu,", sum.shed, sum.bufs);
+	PRINT("\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,",
+	      sum.status[2], sum.status[3], sum.status[4], sum.status[5]);
+	PRINT("\"latency_usec\":{");
+	for (i = n = 0; i < NR_LATENCY; i++)
+		if (sum.latency[i])
+			PRINT("%s\"%lu\":%lu", n++ ? "," : "", 1UL<<i,
+			      sum.latency[i]);
+	PRINT("},\"servers\":[");
+	for (i = 0; i < p->concurrent; i++) {
+		st = &p->servers[i].stats;
+		PRINT("%s{\"cpu\":%d,\"node\":%d,\"conns\":%lu,\"accepts\":%lu,"
+		      "\"requests\":%lu,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+		      "\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,"
+		      "\"shed\":%lu,\"bufs\":%lu,\"lag_usec\":%lu}",
+		      i ? "," : "", p->servers[i].cpu, p->servers[i].node,
+		      stat_read(&st->conns),
+		      stat_read(&st->accepts), stat_read(&st->requests),
+		      stat_read(&st->bytes_in), stat_read(&st->bytes_out),
+		      stat_read(&st->status[2]), stat_read(&st->status[3]),
+		      stat_read(&st->status[4]), stat_read(&st->status[5]),
+		      stat_read(&st->shed), stat_read(&st->bufs),
+		      stat_read(&p->servers[i].lag)/1000);
+	}
+	PRINT("]}\n");
+#undef PRINT
+	return len;
+}
+
+/* format=json anywhere in the query string */
+static int is_json(const struct str *uri)
+{
+	const char *p = uri->ptr+6, *end = uri->ptr+uri->len, *amp;
+	static const char param[] = "format=json";
+
+	if (p == end)
+		return 0;
+	for (p++; p < end; p = amp+1) {
+		amp = memchr(p, '&', end-p);
+		if (amp == NULL)
+			amp = end;
+		if (amp-p == sizeof(param)-1 && !memcmp(p, param, amp-p))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * GET /stats in text, or in JSON with ?format=json.  The body is
+ * rendered into the server's stats buffer, which is shared by all the
+ * connections of the server and rendered again only once nobody is
+ * sending it any more.  A request, HEAD included, coming in while it
+ * is being sent gets a snapshot of its own.
+ */
+static int serve_stats(struct server *ctx, struct conn *c,
+		       const struct request *r, int head)
+{
+	int json = is_json(&r->uri), len;
+	char *buf = ctx->sbuf;
+
+	if (ctx->srefs) {
+		buf = malloc(STATS_SIZE);
+		if (buf == NULL)
+			return respond_error(ctx, c, 500);
+	}
+	if (json)
+		len = render_json(ctx->p, buf, STATS_SIZE);
+	else
+		len = render_text(ctx->p, buf, STATS_SIZE);
+	if (len == -1)
+		goto err;
+	if (respond_header(ctx, c, 200, r->keepalive,
+			   json ? "application/json" : "text/plain", len))
+		goto err;
+	if (head)
+		goto out;
+	if (buf == ctx->sbuf)
+		ctx->srefs++;
+	else
+		c->snap = buf;
+	c->body = buf;
+	c->bleft = len;
+	return 0;
+out:
+	if (buf != ctx->sbuf)
+		free(buf);
+	return 0;
+err:
+	if (buf != ctx->sbuf)
+		free(buf);
+	return len == -1 ? respond_error(ctx, c, 500) : -1;
+}
+
+static int is_stats(const struct request *r)
+{
+	const struct str *u = &r->uri;
+	return u->len >= 6 && !strncmp(u->ptr, "/stats", 6)
+		&& (u->len == 6 || u->ptr[6] == '?');
+}
+
+static int serve_request(struct server *ctx, struct conn *c,
+			 const struct request *r)
+{
+	int head = 0;
+
+	if (str_eq(&r->method, "HEAD"))
+		head = 1;
+	else if (!str_eq(&r->method, "GET"))
+		return respond_error(ctx, c, 501);
+	if (is_stats(r))
+		return serve_stats(ctx, c, r, head);
+	if (ctx->p->rootfd == -1)
+		return respond(ctx, c, 404, r->keepalive, head, "text/plain",
+			       "404 Not Found\n");
+	return serve_file(ctx, c, r, head);
+}
+
+/*
+ * Serve the pipelined requests buffered on the connection, as long as
+ * there is room in the output buffer for another response.  It returns
+ * the number of responses queued, or -1 on error.
+ */
+static int serve_conn(struct server *ctx, struct conn *c)
+{
+	struct request *r = &ctx->req;
+	size_t len;
+	int ret, nr = 0;
+
+	/* a body has to go out before the next response */
+	while (!c->close && c->fd == -1 && c->body == NULL && c->entry == NULL
+	       && OBUF_SIZE-c->olen >= RESP_MAX) {
+		/* drop the previous request body */
+		if (c->skip) {
+			len = c->rlen-c->rpos;
+			if (len > c->skip)
+				len = c->skip;
+			c->rpos += len;
+			c->skip -= len;
+			if (c->skip)
+				break;
+		}
+		if (c->rpos == c->rlen)
+			break;
+		ret = parse_request(c, r);
+		if (ret == 0)
+			break;
+		else if (ret > 0)
+			ret = respond_error(ctx, c, ret);
+		else {
+			/* the last response on a draining server */
+			if (ctx->draining)
+				r->keepalive = 0;
+			ret = serve_request(ctx, c, r);
+		}
+		if (ret == -1)
+			return -1;
+		c->rpos += r->hlen;
+		c->skip = r->clen;
+		c->scan = 0;
+		stat_add(&ctx->stats.requests, 1);
+		stat_add(&ctx->stats.status[c->status/100%6], 1);
+		c->nr_req++;
+		c->nr_resp++;
+		/* the next keep-alive wait is a new one */
+		c->wait = WAIT_NONE;
+		nr++;
+	}
+	return nr;
+}
+
+/* all the queued responses are on the wire */
+static void done_conn(struct server *ctx, struct conn *c)
+{
+	unsigned long now;
+
+	put_file(ctx, c);
+	put_body(ctx, c);
+	if (c->nr_resp == 0)
+		return;
+	now = now_nsec();
+	stat_latency(&ctx->stats, now-c->stamp, c->nr_resp);
+	c->nr_resp = 0;
+	/* the rest of the pipeline arrived with this batch */
+	c->stamp = c->rpos < c->rlen ? c->stamp : 0;
+}
+
+/* data arrival, the latency clock starts with the first byte */
+static void recv_conn(struct server *ctx, struct conn *c, size_t len)
+{
+	if (c->stamp == 0)
+		c->stamp = now_nsec();
+	c->rlen += len;
+	stat_add(&ctx->stats.bytes_in, len);
+}
+
+static struct conn *timer_conn(struct timer *t)
+{
+	return (struct conn *)((char *)t-offsetof(struct conn, timer));
+}
+
+/*
+ * Pick the timeout for what the connection waits for now.  The header
+ * timeout runs from the first byte of a request, so a trickling client
+ * can not stretch it, while the idle timeout restarts on every pass
+ * that finds a response still going out.
+ */
+static void update_timer(struct server *ctx, struct conn *c)
+{
+	const struct process *p = ctx->p;
+	enum wait wait;
+	int msec;
+
+	if (c->opos < c->olen || c->bleft || c->fleft)
+		wait = WAIT_IDLE;
+	else if (c->rpos < c->rlen || c->nr_req == 0)
+		wait = WAIT_HEADER;
+	else
+		wait = WAIT_KEEPALIVE;
+	if (wait == c->wait && wait != WAIT_IDLE)
+		return;
+	c->wait = wait;
+	switch (wait) {
+	case WAIT_HEADER:
+		msec = p->header_timeout;
+		break;
+	case WAIT_KEEPALIVE:
+		msec = p->keepalive_timeout;
+		break;
+	case WAIT_IDLE:
+		msec = p->idle_timeout;
+		break;
+	default:
+		msec = 0;
+		break;
+	}
+	if (msec)
+		add_timer(&ctx->wheel, &c->timer, msec);
+	else
+		del_timer(&ctx->wheel, &c->timer);
+}
+
+/* sweep the wheel up to now, each expired connection goes away */
+static void expire_timers(struct server *ctx)
+{
+	struct wheel *w = &ctx->wheel;
+	unsigned long tick = now_tick();
+	struct timer *head, *t, *next;
+
+	/* a long stall sweeps every slot once */
+	if (tick-w->now > WHEEL_SLOTS)
+		w->now = tick-WHEEL_SLOTS;
+	while (w->nr && w->now < tick) {
+		head = &w->slots[++w->now&(WHEEL_SLOTS-1)];
+		for (t = head->next; t != head; t = next) {
+			next = t->next;
+			if (t->expire > tick)
+				continue; /* a later round */
+			del_timer(w, t);
+			ctx->expire(ctx, timer_conn(t));
+		}
+	}
+	w->now = tick;
+}
+
+/*
+ * The listener went over to the new process.  Every response from now
+ * on closes its connection, and the idle keep-alive ones get a short
+ * grace for a request already on the way.  The server goes away with
+ * its last connection.
+ */
+static void drain_server(struct server *ctx)
+{
+	const struct process *p = ctx->p;
+	eventfd_t val;
+	struct conn *c;
+	int msec = DRAIN_GRACE;
+
+	if (eventfd_read(ctx->evfd, &val) == -1 && errno != EAGAIN)
+		perror("eventfd_read");
+	if (ctx->draining)
+		return;
+	ctx->draining = 1;
+	if (p->keepalive_timeout && p->keepalive_timeout < msec)
+		msec = p->keepalive_timeout;
+	for (c = ctx->conns; c != NULL; c = c->next)
+		if (c->wait == WAIT_KEEPALIVE)
+			add_timer(&ctx->wheel, &c->timer, msec);
+}
+
+/* make room for the rest of the partial request */
+static void compact_conn(struct conn *c)
+{
+	if (c->rpos == c->rlen)
+		c->rpos = c->rlen = 0;
+	else if (c->rpos) {
+		memmove(c->rbuf, c->rbuf+c->rpos, c->rlen-c->rpos);
+		c->rlen -= c->rpos;
+		c->rpos = 0;
+	}
+}
+
+/*
+ * Output buffer, then the cached header block and the rest of the
+ * output buffer when it's a cached response, and the body.
+ */
+static int conn_iov(const struct conn *c, struct iovec *iov)
+{
+	size_t end = c->hleft ? c->hpos : c->olen;
+	int n = 0;
+
+	if (c->opos < end) {
+		iov[n].iov_base = c->obuf+c->opos;
+		iov[n++].iov_len = end-c->opos;
+	}
+	if (c->hleft) {
+		iov[n].iov_base = (void *)c->head;
+		iov[n++].iov_len = c->hleft;
+		if (c->hpos < c->olen) {
+			iov[n].iov_base = c->obuf+c->hpos;
+			iov[n++].iov_len = c->olen-c->hpos;
+		}
+	}
+	if (c->bleft) {
+		iov[n].iov_base = (void *)c->body;
+		iov[n++].iov_len = c->bleft;
+	}
+	return n;
+}
+
+static void conn_sent(struct conn *c, size_t len)
+{
+	size_t n, end = c->hleft ? c->hpos : c->olen;
+
+	n = len < end-c->opos ? len : end-c->opos;
+	c->opos += n;
+	len -= n;
+	n = len < c->hleft ? len : c->hleft;
+	c->head += n;
+	c->hleft -= n;
+	len -= n;
+	n = len < c->olen-c->opos ? len : c->olen-c->opos;
+	c->opos += n;
+	len -= n;
+	c->body += len;
+	c->bleft -= len;
+	if (c->opos == c->olen && c->hleft == 0)
+		c->opos = c->olen = c->hpos = 0;
+}
+
+/*
+ * The queued responses go out in one gathered send.  The header of a
+ * file body is held back with MSG_MORE, so that it leaves in the same
+ * segment as the head of the body from sendfile(2), which pushes the
+ * lot out with its last page.
+ */
+static int send_flags(const struct conn *c)
+{
+	return MSG_NOSIGNAL|(c->fleft ? MSG_MORE : 0);
+}
+
+/* returns 1 when the socket would block, 0 when flushed, -1 on error */
+static int flush_conn(struct server *ctx, struct conn *c)
+{
+	struct iovec iov[NR_IOV];
+	struct msghdr msg = {.msg_iov = iov};
+	ssize_t len;
+
+	while ((msg.msg_iovlen = conn_iov(c, iov))) {
+		len = sendmsg(c->sd, &msg, send_flags(c));
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			if (errno != EPIPE && errno != ECONNRESET)
+				perror("sendmsg");
+			return -1;
+		}
+		conn_sent(c, len);
+		stat_add(&ctx->stats.bytes_out, len);
+	}
+	while (c->fleft) {
+		len = sendfile(c->sd, c->fd, &c->foff,
+			       c->fleft < SENDFILE_MAX ? c->fleft : SENDFILE_MAX);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			if (errno != EPIPE && errno != ECONNRESET)
+				perror("sendfile");
+			return -1;
+		} else if (len == 0) {
+			/* truncated under us, the length is already out */
+			return -1;
+		}
+		c->fleft -= len;
+		stat_add(&ctx->stats.bytes_out, len);
+	}
+	done_conn(ctx, c);
+	return 0;
+}
+
+static int accept_conn(struct server *ctx, const struct acceptor *a)
+{
+	struct epoll_event ev;
+	struct conn *c;
+	int ret, sd;
+
+	/* edge triggered, drain the whole accept queue */
+	while (!ctx->paused) {
+		sd = accept4(a->sd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (sd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept4");
+			return -1;
+		}
+		c = admit_conn(ctx, sd);
+		if (c == NULL)
+			continue;
+		ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+		ev.data.ptr = c;
+		ret = epoll_ctl(ctx->efd, EPOLL_CTL_ADD, sd, &ev);
+		if (ret == -1) {
+			perror("epoll_ctl(conn)");
+			close_conn(ctx, c);
+			continue;
+		}
+		update_timer(ctx, c);
+	}
+	return 0;
+}
+
+static void handle_conn(struct server *ctx, struct conn *c, uint32_t events)
+{
+	ssize_t len;
+	int ret;
+
+	if (events & EPOLLERR)
+		goto close;
+	/*
+	 * Edge triggered: keep flushing, serving and reading until the
+	 * socket either would block or the peer is gone.
+	 */
+	for (;;) {
+		ret = flush_conn(ctx, c);
+		if (ret == -1)
+			goto close;
+		else if (ret == 1)
+			goto wait; /* for EPOLLOUT */
+		if (c->close)
+			goto close;
+		ret = serve_conn(ctx, c);
+		if (ret == -1)
+			goto close;
+		else if (ret > 0)
+			continue;
+		compact_conn(c);
+		if (c->rlen == RBUF_SIZE) {
+			if (respond_error(ctx, c, 431))
+				goto close;
+			continue;
+		}
+		if (get_buf(ctx, c))
+			goto close;
+		len = recv(c->sd, c->rbuf+c->rlen, RBUF_SIZE-c->rlen, 0);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto wait;
+			if (errno == EINTR)
+				continue;
+			if (errno != ECONNRESET)
+				perror("recv");
+			goto close;
+		} else if (len == 0)
+			goto close;
+		recv_conn(ctx, c, len);
+	}
+wait:
+	put_buf(ctx, c);
+	update_timer(ctx, c);
+	return;
+close:
+	close_conn(ctx, c);
+}
+
+/*
+ * A shared AF_UNIX listener wakes up only one of the servers waiting
+ * on it, not the whole herd.
+ */
+static uint32_t listen_events(const struct listener *l)
+{
+	if (l->domain == AF_UNIX)
+		return EPOLLIN|EPOLLET|EPOLLEXCLUSIVE;
+	return EPOLLIN|EPOLLET;
+}
+
+static void epoll_listen(struct server *ctx, int on)
+{
+	struct acceptor *a, *end = ctx->acceptors + ctx->p->nr_listeners;
+	struct epoll_event ev;
+	int ret;
+
+	for (a = ctx->acceptors; a < end; a++) {
+		if (a->sd == -1)
+			continue;
+		ev.events = listen_events(a->l);
+		ev.data.ptr = a;
+		ret = epoll_ctl(ctx->efd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+				a->sd, &ev);
+		if (ret == -1)
+			perror("epoll_ctl(listener)");
+	}
+}
+
+/* listeners are tagged with their acceptor, connections with the conn */
+static struct acceptor *event_acceptor(struct server *ctx, void *ptr)
+{
+	uintptr_t off = (uintptr_t)ptr - (uintptr_t)ctx->acceptors;
+
+	if (off >= sizeof(ctx->acceptors))
+		return NULL;
+	return ptr;
+}
+
+static int init_epoll(struct server *ctx)
+{
+	struct acceptor *a, *end = ctx->acceptors + ctx->p->nr_listeners;
+	struct epoll_event ev;
+	int ret;
+
+	ctx->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->efd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (a = ctx->acceptors; a < end; a++) {
+		if (a->sd == -1)
+			continue;
+		ev.events = listen_events(a->l);
+		ev.data.ptr = a;
+		ret = epoll_ctl(ctx->efd, EPOLL_CTL_ADD, a->sd, &ev);
+		if (ret == -1) {
+			perror("epoll_ctl(listener)");
+			return -1;
+		}
+	}
+#ifdef HAVE_EPOLL_PARAMS
+	/* SO_BUSY_POLL alone only spins in a blocking receive */
+	if (ctx->p->busy_poll) {
+		struct epoll_params params = {
+			.busy_poll_usecs	= ctx->p->busy_poll,
+			.busy_poll_budget	= 8,
+		};
+		ret = ioctl(ctx->efd, EPIOCSPARAMS, &params);
+		if (ret == -1)
+			perror("ioctl(EPIOCSPARAMS)");
+	}
+#endif /* HAVE_EPOLL_PARAMS */
+	/* and the drain request with its eventfd */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ctx->evfd;
+	ret = epoll_ctl(ctx->efd, EPOLL_CTL_ADD, ctx->evfd, &ev);
+	if (ret == -1) {
+		perror("epoll_ctl(eventfd)");
+		return -1;
+	}
+	return 0;
+}
+
+static int epoll_loop(struct server *ctx)
+{
+	struct epoll_event *e;
+	struct acceptor *a;
+	unsigned long start;
+	int i, nr;
+
+	ctx->expire = close_conn;
+	ctx->listen = epoll_listen;
+	while (!ctx->draining || ctx->nr_conns) {
+		nr = epoll_wait(ctx->efd, ctx->events, NR_EVENTS,
+				loop_timeout(ctx));
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+		start = now_nsec();
+		update_clock(&ctx->clock);
+		for (i = 0, e = ctx->events; i < nr; i++, e++) {
+			a = event_acceptor(ctx, e->data.ptr);
+			if (a != NULL) {
+				accept_conn(ctx, a);
+				continue;
+			}
+			if (e->data.ptr == &ctx->evfd) {
+				pause_accept(ctx);
+				drain_server(ctx);
+				continue;
+			}
+			handle_conn(ctx, e->data.ptr, e->events);
+		}
+		expire_timers(ctx);
+		trim_bufs(ctx);
+		update_load(ctx, start);
+	}
+	return 0;
+}
+
+#ifdef HAVE_URING
+/*
+ * io_uring engine.  The listener has a multishot accept armed, every
+ * connection has at most one receive in flight, which picks a buffer
+ * out of the provided buffer ring, and a response goes out as a send
+ * that is linked to shutdown and close when it is the last one.  File
+ * bodies still go through sendfile(2), with a poll request armed when
+ * the socket buffer is full.
+ */
+enum uring_op {
+	URING_ACCEPT = 1,
+	URING_RECV,
+	URING_SEND,
+	URING_POLL,
+	URING_SHUTDOWN,
+	URING_CLOSE,
+	URING_WAKE,
+};
+
+#define URING_OP_MASK	7UL
+
+static void *uring_ptr(__u64 data)
+{
+	return (void *)(uintptr_t)(data&~URING_OP_MASK);
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(const struct uring *u, unsigned submit, unsigned wait,
+		       unsigned flags, int msec)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec		= msec/1000,
+		.tv_nsec	= (msec%1000)*1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts		= (__u64)(uintptr_t)&ts,
+	};
+
+	if (msec < 0)
+		return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags,
+			       NULL, 0);
+	return syscall(__NR_io_uring_enter, u->fd, submit, wait,
+		       flags|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static int uring_register(const struct uring *u, unsigned opcode, void *arg,
+			  unsigned nr)
+{
+	return syscall(__NR_io_uring_register, u->fd, opcode, arg, nr);
+}
+
+static int uring_submit(struct uring *u, unsigned wait, int msec)
+{
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	unsigned submit;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	submit = u->tail-__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return 0;
+	ret = uring_enter(u, submit, wait, flags, wait ? msec : -1);
+	if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY
+	    && errno != ETIME) {
+		perror("io_uring_enter");
+		return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u, void *ptr,
+				      enum uring_op op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	/* the kernel consumes the whole queue on every submission */
+	if (u->tail-__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+		if (uring_submit(u, 0, -1) == -1)
+			return NULL;
+	if (u->tail-__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+		return NULL;
+	idx = u->tail&*u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (__u64)(uintptr_t)ptr|op;
+	u->sq_array[idx] = idx;
+	u->tail++;
+	return sqe;
+}
+
+static void uring_put_buf(struct uring *u, unsigned short bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail&(NR_URING_BUFS-1)];
+
+	b->addr = (__u64)(uintptr_t)(u->bufs+bid*URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_accept(struct server *ctx, struct acceptor *a)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ctx->ring, a, URING_ACCEPT);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = a->sd;
+	/*
+	 * A multishot accept keeps on taking the connections off the
+	 * queue while the cancel is on the way, so pausing takes them
+	 * one at a time.
+	 */
+	if (ctx->p->overload != OVERLOAD_PAUSE)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+	a->accepting = 1;
+	return 0;
+}
+
+/* the drain request, see drain_server() */
+static int uring_wake(struct server *ctx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ctx->ring, ctx, URING_WAKE);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ctx->evfd;
+	sqe->poll32_events = POLLIN;
+	return 0;
+}
+
+static int uring_cancel_accept(struct server *ctx, const struct acceptor *a)
+{
+	struct io_uring_sqe *sqe;
+
+	/* nobody waits for the cancel itself */
+	sqe = uring_sqe(&ctx->ring, NULL, 0);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (__u64)(uintptr_t)a|URING_ACCEPT;
+	return 0;
+}
+
+/*
+ * The accept is armed again once the cancelled one completes, if the
+ * server is taking connections by then, see uring_complete().
+ */
+static void uring_listen(struct server *ctx, int on)
+{
+	struct acceptor *a, *end = ctx->acceptors + ctx->p->nr_listeners;
+	int ret;
+
+	for (a = ctx->acceptors; a < end; a++) {
+		if (a->sd == -1)
+			continue;
+		ret = 0;
+		if (on && !a->accepting)
+			ret = uring_accept(ctx, a);
+		else if (!on && a->accepting)
+			ret = uring_cancel_accept(ctx, a);
+		if (ret)
+			ctx->status = EXIT_FAILURE;
+	}
+}
+
+static int uring_recv(struct server *ctx, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ctx->ring, c, URING_RECV);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sd;
+	sqe->len = RBUF_SIZE-c->rlen;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	c->reading = 1;
+	c->ops++;
+	return 0;
+}
+
+static int uring_poll(struct server *ctx, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ctx->ring, c, URING_POLL);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = c->sd;
+	sqe->poll32_events = POLLOUT;
+	c->polling = 1;
+	c->ops++;
+	return 0;
+}
+
+/* shutdown(2) completes the pending receive, close(2) follows it */
+static int uring_close(struct server *ctx, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	c->closing = 1;
+	del_timer(&ctx->wheel, &c->timer);
+	sqe = uring_sqe(&ctx->ring, c, URING_SHUTDOWN);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->fd = c->sd;
+	sqe->len = SHUT_RDWR;
+	sqe->flags = IOSQE_IO_LINK;
+	c->ops++;
+	sqe = uring_sqe(&ctx->ring, c, URING_CLOSE);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = c->sd;
+	c->ops++;
+	return 0;
+}
+
+/* the last response is linked to the shutdown and close requests */
+static int uring_send(struct server *ctx, struct conn *c, int last)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ctx->ring, c, URING_SEND);
+	if (sqe == NULL)
+		return -1;
+	memset(&c->msg, 0, sizeof(c->msg));
+	c->msg.msg_iov = c->iov;
+	c->msg.msg_iovlen = conn_iov(c, c->iov);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = c->sd;
+	sqe->addr = (__u64)(uintptr_t)&c->msg;
+	sqe->len = 1;
+	sqe->msg_flags = send_flags(c);
+	c->sending = 1;
+	c->ops++;
+	if (!last)
+		return 0;
+	/* a short send breaks the link, see uring_complete() */
+	sqe->msg_flags |= MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	return uring_close(ctx, c);
+}
+
+/* no submission queue entry; tear the connection down synchronously */
+static void uring_abort(struct server *ctx, struct conn *c)
+{
+	c->closing = 1;
+	del_timer(&ctx->wheel, &c->timer);
+	if (c->ops == 0) {
+		close_conn(ctx, c);
+		return;
+	}
+	/* let the in flight requests complete first */
+	if (shutdown(c->sd, SHUT_RDWR))
+		perror("shutdown");
+}
+
+/* drive the connection as far as it goes without blocking */
+static void uring_advance(struct server *ctx, struct conn *c)
+{
+	ssize_t len;
+	int ret;
+
+	if (c->closing || c->sending || c->polling)
+		return;
+	for (;;) {
+		if (c->opos < c->olen || c->hleft || c->bleft) {
+			ret = uring_send(ctx, c, c->close && c->fleft == 0);
+			if (ret == -1)
+				goto abort;
+			goto wait;
+		}
+		if (c->fleft) {
+			len = sendfile(c->sd, c->fd, &c->foff,
+				       c->fleft < SENDFILE_MAX ? c->fleft : SENDFILE_MAX);
+			if (len == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					goto close;
+				if (uring_poll(ctx, c))
+					goto abort;
+				goto wait;
+			} else if (len == 0)
+				goto close;
+			c->fleft -= len;
+			stat_add(&ctx->stats.bytes_out, len);
+			continue;
+		}
+		done_conn(ctx, c);
+		if (c->close)
+			goto close;
+		ret = serve_conn(ctx, c);
+		if (ret == -1)
+			goto close;
+		else if (ret > 0)
+			continue;
+		compact_conn(c);
+		if (c->rlen == RBUF_SIZE) {
+			if (respond_error(ctx, c, 431))
+				goto close;
+			continue;
+		}
+		if (!c->reading)
+			if (uring_recv(ctx, c))
+				goto abort;
+		goto wait;
+	}
+wait:
+	/* the final send took the connection down with it */
+	if (c->closing)
+		return;
+	put_buf(ctx, c);
+	update_timer(ctx, c);
+	return;
+close:
+	if (uring_close(ctx, c) == 0)
+		return;
+abort:
+	uring_abort(ctx, c);
+}
+
+static void uring_expire(struct server *ctx, struct conn *c)
+{
+	if (c->closing)
+		return;
+	if (uring_close(ctx, c))
+		uring_abort(ctx, c);
+}
+
+static void uring_complete(struct server *ctx, const struct io_uring_cqe *cqe)
+{
+	struct uring *u = &ctx->ring;
+	struct conn *c = uring_ptr(cqe->user_data);
+	struct acceptor *a;
+	unsigned short bid;
+	int res = cqe->res;
+	struct conn *nc;
+
+	switch (cqe->user_data&URING_OP_MASK) {
+	case URING_ACCEPT:
+		a = uring_ptr(cqe->user_data);
+		if (res >= 0) {
+			nc = admit_conn(ctx, res);
+			if (nc != NULL)
+				uring_advance(ctx, nc);
+		} else if (res != -EAGAIN && res != -ECONNABORTED
+			   && res != -EINTR && res != -ECANCELED)
+			fprintf(stderr, "accept: %s\n", strerror(-res));
+		if (!(cqe->flags&IORING_CQE_F_MORE)) {
+			a->accepting = 0;
+			if (!ctx->paused && uring_accept(ctx, a))
+				ctx->status = EXIT_FAILURE;
+		}
+		return;
+	case URING_WAKE:
+		if (res < 0) {
+			fprintf(stderr, "poll(eventfd): %s\n", strerror(-res));
+			ctx->status = EXIT_FAILURE;
+			return;
+		}
+		pause_accept(ctx);
+		drain_server(ctx);
+		return;
+	case URING_RECV:
+		c->reading = 0;
+		if (cqe->flags&IORING_CQE_F_BUFFER) {
+			bid = cqe->flags>>IORING_CQE_BUFFER_SHIFT;
+			if (res > 0 && !c->closing && get_buf(ctx, c))
+				res = -ENOMEM;
+			else if (res > 0 && !c->closing) {
+				memcpy(c->rbuf+c->rlen,
+				       u->bufs+bid*URING_BUF_SIZE, res);
+				recv_conn(ctx, c, res);
+			}
+			uring_put_buf(u, bid);
+		}
+		if (c->closing || res == -ENOBUFS)
+			break;
+		if (res <= 0) {
+			if (res < 0 && res != -ECONNRESET)
+				fprintf(stderr, "recv: %s\n", strerror(-res));
+			if (uring_close(ctx, c))
+				uring_abort(ctx, c);
+		}
+		break;
+	case URING_SEND:
+		c->sending = 0;
+		if (res > 0) {
+			conn_sent(c, res);
+			stat_add(&ctx->stats.bytes_out, res);
+		}
+		if (res < 0 && !c->closing) {
+			if (res != -EPIPE && res != -ECONNRESET)
+				fprintf(stderr, "send: %s\n", strerror(-res));
+			if (uring_close(ctx, c))
+				uring_abort(ctx, c);
+		}
+		break;
+	case URING_POLL:
+		c->polling = 0;
+		break;
+	case URING_SHUTDOWN:
+		break;
+	case URING_CLOSE:
+		/* the link was broken by a short send, close it here */
+		if (res == -ECANCELED) {
+			if (close(c->sd))
+				perror("close");
+		} else if (res < 0)
+			fprintf(stderr, "close: %s\n", strerror(-res));
+		c->sd = -1;
+		break;
+	default:
+		return;
+	}
+	if (--c->ops == 0 && c->closing) {
+		close_conn(ctx, c);
+		return;
+	}
+	uring_advance(ctx, c);
+}
+
+static void term_uring(struct uring *u)
+{
+	if (u->br != NULL)
+		munmap(u->br, u->br_len);
+	if (u->bufs != NULL)
+		free(u->bufs);
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_len);
+	if (u->sq_ring != NULL)
+		munmap(u->sq_ring, u->sq_len);
+	if (u->fd != -1)
+		if (close(u->fd))
+			perror("close(io_uring)");
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+static int init_uring(struct server *ctx)
+{
+	static const int ops[] = {
+		IORING_OP_ACCEPT,
+		IORING_OP_RECV,
+		IORING_OP_SENDMSG,
+		IORING_OP_POLL_ADD,
+		IORING_OP_SHUTDOWN,
+		IORING_OP_CLOSE,
+		IORING_OP_ASYNC_CANCEL,
+		-1, /* sentry */
+	};
+	struct acceptor *a, *end = ctx->acceptors + ctx->p->nr_listeners;
+	struct uring *u = &ctx->ring;
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	struct io_uring_probe *probe;
+	unsigned char *sq;
+	int i, ret;
+
+	memset(u, 0, sizeof(*u));
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN;
+	u->fd = uring_setup(URING_ENTRIES, &params);
+	if (u->fd == -1 && errno == EINVAL) {
+		/* pre v6.0 kernel */
+		memset(&params, 0, sizeof(params));
+		u->fd = uring_setup(URING_ENTRIES, &params);
+	}
+	if (u->fd == -1) {
+		perror("io_uring_setup");
+		return -1;
+	}
+	/* the timer wheel drives the wait timeout, v5.11 */
+	if (!(params.features&IORING_FEAT_EXT_ARG)) {
+		fprintf(stderr, "io_uring: no IORING_FEAT_EXT_ARG\n");
+		goto err;
+	}
+	u->sq_len = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+	u->cq_len = params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features&IORING_FEAT_SINGLE_MMAP)
+		u->sq_len = u->cq_len = u->sq_len > u->cq_len ? u->sq_len : u->cq_len;
+	u->sq_ring = mmap(NULL, u->sq_len, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		perror("mmap(sq)");
+		u->sq_ring = NULL;
+		goto err;
+	}
+	u->cq_ring = u->sq_ring;
+	if (!(params.features&IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ring = mmap(NULL, u->cq_len, PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			perror("mmap(cq)");
+			u->cq_ring = NULL;
+			goto err;
+		}
+	}
+	u->sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		perror("mmap(sqes)");
+		u->sqes = NULL;
+		goto err;
+	}
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq+params.sq_off.head);
+	u->sq_tail = (unsigned *)(sq+params.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq+params.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq+params.sq_off.array);
+	u->sq_entries = params.sq_entries;
+	u->tail = *u->sq_tail;
+	sq = u->cq_ring;
+	u->cq_head = (unsigned *)(sq+params.cq_off.head);
+	u->cq_tail = (unsigned *)(sq+params.cq_off.tail);
+	u->cq_mask = (unsigned *)(sq+params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(sq+params.cq_off.cqes);
+
+	/* make sure the kernel knows all the requests we issue */
+	probe = calloc(1, sizeof(*probe)+IORING_OP_LAST*sizeof(probe->ops[0]));
+	if (probe == NULL) {
+		perror("calloc");
+		goto err;
+	}
+	ret = uring_register(u, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+	for (i = 0; ret == 0 && ops[i] != -1; i++)
+		if (ops[i] > probe->last_op
+		    || !(probe->ops[ops[i]].flags&IO_URING_OP_SUPPORTED)) {
+			errno = EOPNOTSUPP;
+			ret = -1;
+		}
+	free(probe);
+	if (ret == -1) {
+		perror("io_uring_register(IORING_REGISTER_PROBE)");
+		goto err;
+	}
+
+	/* provided buffer ring */
+	u->br_len = NR_URING_BUFS*sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_len, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		perror("mmap(buf_ring)");
+		u->br = NULL;
+		goto err;
+	}
+	u->bufs = malloc(NR_URING_BUFS*URING_BUF_SIZE);
+	if (u->bufs == NULL) {
+		perror("malloc");
+		goto err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (__u64)(uintptr_t)u->br;
+	reg.ring_entries = NR_URING_BUFS;
+	reg.bgid = 0;
+	ret = uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret == -1) {
+		perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+		goto err;
+	}
+	for (i = 0; i < NR_URING_BUFS; i++)
+		uring_put_buf(u, i);
+	if (uring_wake(ctx))
+		goto err;
+	for (a = ctx->acceptors; a < end; a++)
+		if (a->sd != -1 && uring_accept(ctx, a))
+			goto err;
+	return 0;
+err:
+	term_uring(u);
+	return -1;
+}
+
+static int uring_loop(struct server *ctx)
+{
+	struct uring *u = &ctx->ring;
+	unsigned long start;
+	unsigned head, tail;
+	int ret;
+
+	ctx->expire = uring_expire;
+	ctx->listen = uring_listen;
+	while (ctx->status == EXIT_SUCCESS
+	       && (!ctx->draining || ctx->nr_conns)) {
+		ret = uring_submit(u, 1, loop_timeout(ctx));
+		if (ret == -1)
+			return -1;
+		start = now_nsec();
+		update_clock(&ctx->clock);
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			uring_complete(ctx, &u->cqes[head&*u->cq_mask]);
+			/* the completion may submit, keep the queue moving */
+			__atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+		}
+		expire_timers(ctx);
+		trim_bufs(ctx);
+		update_load(ctx, start);
+	}
+	return ctx->status == EXIT_SUCCESS ? 0 : -1;
+}
+#endif /* HAVE_URING */
+
+static void *server(void *arg)
+{
+	struct server *ctx = arg;
+	int ret;
+
+	ctx->status = EXIT_FAILURE;
+	ret = init_server(ctx);
+	if (ret == -1)
+		return &ctx->status;
+	ctx->status = EXIT_SUCCESS;
+#ifdef HAVE_URING
+	if (ctx->p->engine == ENGINE_URING) {
+		ret = init_uring(ctx);
+		if (ret == 0) {
+			ret = uring_loop(ctx);
+			term_uring(&ctx->ring);
+			goto out;
+		}
+		fprintf(stderr, "io_uring is not available, fall back to epoll\n");
+	}
+#else
+	if (ctx->p->engine == ENGINE_URING)
+		fprintf(stderr, "io_uring is not supported, fall back to epoll\n");
+#endif /* HAVE_URING */
+	ret = init_epoll(ctx);
+	if (ret == 0)
+		ret = epoll_loop(ctx);
+out:
+	if (ret == -1)
+		ctx->status = EXIT_FAILURE;
+	ret = term_server(ctx);
+	if (ret == -1)
+		ctx->status = EXIT_FAILURE;
+	return &ctx->status;
+}
+
+static int read_topology(const char *name, int cpu, int def)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int val;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return def;
+	if (fscanf(fp, "%d", &val) != 1)
+		val = def;
+	fclose(fp);
+	return val;
+}
+
+/* the cpuN directory has a nodeM link to its NUMA node */
+static int read_node(int cpu)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	int node = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while ((d = readdir(dir)) != NULL)
+		if (sscanf(d->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return d == NULL ? 0 : node;
+}
+
+static int same_core(const struct cpu *a, const struct cpu *b)
+{
+	return a->node == b->node && a->package == b->package
+		&& a->core == b->core;
+}
+
+static int cmp_core(const struct cpu *a, const struct cpu *b)
+{
+	if (a->package != b->package)
+		return a->package - b->package;
+	return a->core - b->core;
+}
+
+/* node by node, core by core, SMT siblings next to each other */
+static int cmp_compact(const void *x, const void *y)
+{
+	const struct cpu *a = x, *b = y;
+
+	if (a->node != b->node)
+		return a->node - b->node;
+	if (cmp_core(a, b))
+		return cmp_core(a, b);
+	return a->thread - b->thread;
+}
+
+/* round robin over the nodes, then the cores, then the siblings */
+static int cmp_spread(const void *x, const void *y)
+{
+	const struct cpu *a = x, *b = y;
+
+	if (a->thread != b->thread)
+		return a->thread - b->thread;
+	if (a->rank != b->rank)
+		return a->rank - b->rank;
+	return a->node - b->node;
+}
+
+/*
+ * Collects the CPUs in the process affinity mask and orders them by
+ * the placement policy.  Missing sysfs entries make every CPU its own
+ * core on node 0.
+ */
+static int init_topology(struct process *p)
+{
+	int i, j, n, nr = get_nprocs_conf();
+	struct cpu *a, *b;
+	cpu_set_t *set;
+	size_t size;
+	int ret = -1;
+
+	set = CPU_ALLOC(nr);
+	if (set == NULL) {
+		perror("CPU_ALLOC");
+		return -1;
+	}
+	size = CPU_ALLOC_SIZE(nr);
+	if (sched_getaffinity(0, size, set) == -1) {
+		perror("sched_getaffinity");
+		goto out;
+	}
+	p->cpus = calloc(CPU_COUNT_S(size, set), sizeof(struct cpu));
+	if (p->cpus == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		if (!CPU_ISSET_S(i, size, set))
+			continue;
+		a = &p->cpus[p->nr_cpus++];
+		a->cpu = i;
+		a->core = read_topology("core_id", i, i);
+		a->package = read_topology("physical_package_id", i, 0);
+		a->node = read_node(i);
+	}
+	/* sibling index first, as the core rank counts the first siblings */
+	for (a = p->cpus; a < p->cpus + p->nr_cpus; a++)
+		for (b = p->cpus; b < a; b++)
+			if (same_core(a, b))
+				a->thread++;
+	for (a = p->cpus; a < p->cpus + p->nr_cpus; a++)
+		for (b = p->cpus; b < p->cpus + p->nr_cpus; b++)
+			if (b->thread == 0 && a->node == b->node
+			    && cmp_core(b, a) < 0)
+				a->rank++;
+	switch (p->placement) {
+	case PLACE_CORE:
+		for (i = j = 0; i < p->nr_cpus; i++)
+			if (p->cpus[i].thread == 0)
+				p->cpus[j++] = p->cpus[i];
+		p->nr_cpus = j;
+		/* fall through */
+	case PLACE_COMPACT:
+	case PLACE_NUMA:
+		qsort(p->cpus, p->nr_cpus, sizeof(struct cpu), cmp_compact);
+		break;
+	case PLACE_SPREAD:
+	default:
+		qsort(p->cpus, p->nr_cpus, sizeof(struct cpu), cmp_spread);
+		break;
+	}
+	for (i = n = 0; i < p->nr_cpus; i++)
+		if (i == 0 || p->cpus[i].node != p->cpus[i - 1].node)
+			n++;
+	p->nr_nodes = n;
+	ret = 0;
+out:
+	CPU_FREE(set);
+	return ret;
+}
+
+/*
+ * Picks the CPUs of the i-th server.  It's a single CPU except for
+ * the NUMA policy, where the servers go round robin over the nodes and
+ * the scheduler is free to move them within the node.
+ */
+static const struct cpu *place_server(const struct process *p, int i,
+				      size_t size, cpu_set_t *set)
+{
+	const struct cpu *c, *first, *end = p->cpus + p->nr_cpus;
+	int n;
+
+	CPU_ZERO_S(size, set);
+	if (p->placement != PLACE_NUMA) {
+		c = &p->cpus[i%p->nr_cpus];
+		CPU_SET_S(c->cpu, size, set);
+		return c;
+	}
+	/* skip to the first CPU of the n-th node */
+	for (n = i%p->nr_nodes, first = p->cpus; n > 0; first++)
+		if (first[1].node != first->node)
+			n--;
+	for (c = first; c < end && c->node == first->node; c++)
+		CPU_SET_S(c->cpu, size, set);
+	return first;
+}
+
+/*
+ * Classic BPF run by the reuseport group on every SYN, which returns
+ * the index of the listener owned by the server pinned to the CPU the
+ * SYN is processed on.  Servers sharing CPUs, as with the NUMA
+ * placement, take them in turn.  CPUs without a server get an index out
+ * of the group, which falls back to the kernel hash.  A group only has
+ * the servers of its listener, in the server order.
+ */
+static int init_steering(const struct process *p, const struct listener *l,
+			 int sd, size_t size, cpu_set_t *set)
+{
+	struct sock_filter code[BPF_MAXINSNS];
+	struct sock_fprog prog = {.filter = code};
+	int i, idx, cpu, claimed, n = 0, nr = get_nprocs_conf();
+	int ret = -1;
+	short *owner;
+
+	owner = malloc(nr*sizeof(short));
+	if (owner == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (cpu = 0; cpu < nr; cpu++)
+		owner[cpu] = -1;
+	do {
+		claimed = 0;
+		for (i = idx = 0; i < p->concurrent; i++) {
+			if (!l->servers[i])
+				continue;
+			place_server(p, i, size, set);
+			for (cpu = 0; cpu < nr; cpu++)
+				if (CPU_ISSET_S(cpu, size, set)
+				    && owner[cpu] == -1) {
+					owner[cpu] = idx;
+					claimed++;
+					break;
+				}
+			idx++;
+		}
+	} while (claimed);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+						 SKF_AD_OFF+SKF_AD_CPU);
+	for (cpu = 0; cpu < nr && n < BPF_MAXINSNS-2; cpu++) {
+		if (owner[cpu] == -1)
+			continue;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+							 cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K,
+							 owner[cpu]);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, UINT_MAX);
+	prog.len = n;
+	ret = setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			 sizeof(prog));
+	if (ret == -1)
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+	free(owner);
+	return ret;
+}
+
+/*
+ * The listeners of the previous process, a message per address with
+ * the sockets in its server order, and the byte telling how many more
+ * messages follow.  It returns the number of addresses, or -1 on error.
+ */
+static int recv_listeners(const struct process *p, int fds[][SCHAR_MAX],
+			  int *nr_fds)
+{
+	char cbuf[CMSG_SPACE(SCHAR_MAX*sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+	char byte;
+	int i, nr = 0;
+
+	do {
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		do
+			len = recvmsg(p->inherit_fd, &msg, MSG_CMSG_CLOEXEC);
+		while (len == -1 && errno == EINTR);
+		if (len == -1) {
+			perror("recvmsg");
+			goto err;
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (len == 0 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS) {
+			fprintf(stderr, "no listener to inherit\n");
+			goto err;
+		}
+		nr_fds[nr] = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+		memcpy(fds[nr], CMSG_DATA(cmsg), nr_fds[nr]*sizeof(int));
+		if (++nr == NR_LISTENERS && byte) {
+			fprintf(stderr, "too many listeners to inherit\n");
+			goto err;
+		}
+	} while (byte);
+	return nr;
+err:
+	while (nr--)
+		for (i = 0; i < nr_fds[nr]; i++)
+			close(fds[nr][i]);
+	return -1;
+}
+
+static int init(struct process *p)
+{
+	int fds[NR_LISTENERS][SCHAR_MAX], nr_fds[NR_LISTENERS];
+	int taken[NR_LISTENERS] = {0}, nr_inherit = 0;
+	struct server *s, *ss = NULL;
+	size_t size, nr = get_nprocs_conf();
+	const struct listener *l;
+	const struct cpu *c;
+	struct acceptor *a;
+	pthread_attr_t attr;
+	cpu_set_t *cpus = NULL;
+	sigset_t mask;
+	int i = 0, j, k, sd, ret;
+
+	/* reload is for the main thread only, see main() */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_sigmask");
+		return -1;
+	}
+	if (p->inherit_fd != -1) {
+		nr_inherit = recv_listeners(p, fds, nr_fds);
+		if (nr_inherit == -1)
+			return -1;
+	}
+
+	if (p->root) {
+		p->rootfd = open(p->root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (p->rootfd == -1) {
+			perror(p->root);
+			return -1;
+		}
+	}
+	if (p->cache_size && p->rootfd != -1) {
+		p->cache = init_cache(p->cache_size);
+		if (p->cache == NULL)
+			return -1;
+	}
+	if (init_topology(p) == -1)
+		goto err;
+	cpus = CPU_ALLOC(nr);
+	if (cpus == NULL) {
+		perror("CPU_ALLOC");
+		goto err;
+	}
+	size = CPU_ALLOC_SIZE(nr);
+	/*
+	 * Zeroed on demand, so that only the first page of each server is
+	 * touched here, and the rest by the server on its own node.  A
+	 * cache epoch of 0 holds the reclaim back until it's up.
+	 */
+	ss = mmap(NULL, p->concurrent*sizeof(struct server),
+		  PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ss == MAP_FAILED) {
+		perror("mmap(servers)");
+		ss = NULL;
+		goto err;
+	}
+	/* /stats walks through all the servers */
+	p->servers = ss;
+	for (j = 0; j < p->concurrent; j++) {
+		for (k = 0; k < NR_LISTENERS; k++)
+			ss[j].acceptors[k].sd = -1;
+		ss[j].evfd = -1;
+	}
+	for (j = 0; j < p->concurrent; j++) {
+		s = &ss[j];
+		s->p = p;
+		s->id = j;
+		c = place_server(p, j, size, cpus);
+		s->cpu = c->cpu;
+		s->node = c->node;
+		for (k = 0; k < p->nr_listeners; k++) {
+			l = &p->listeners[k];
+			if (!l->servers[j])
+				continue;
+			a = &s->acceptors[k];
+			a->l = l;
+			sd = -1;
+			if (k < nr_inherit && taken[k] < nr_fds[k]) {
+				sd = fds[k][taken[k]];
+				fds[k][taken[k]++] = -1;
+			}
+			ret = init_listener(s, a, sd);
+			if (ret == -1)
+				goto err;
+		}
+		s->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (s->evfd == -1) {
+			perror("eventfd");
+			goto err;
+		}
+	}
+	/*
+	 * The previous process ran more servers or listeners.  The
+	 * connections queued on the surplus ones would be lost with it, so
+	 * it keeps on serving instead.
+	 */
+	for (k = 0; k < nr_inherit; k++)
+		if (k >= p->nr_listeners || taken[k] < nr_fds[k]) {
+			fprintf(stderr, "fewer servers or listeners than the previous process\n");
+			goto err;
+		}
+	for (k = 0; p->steer && k < p->nr_listeners; k++) {
+		l = &p->listeners[k];
+		for (j = 0; !l->servers[j]; j++)
+			;
+		if (init_steering(p, l, ss[j].acceptors[k].sd, size, cpus) == -1)
+			goto err;
+	}
+	s = ss;
+	for (i = 0; i < p->concurrent; i++) {
+		place_server(p, i, size, cpus);
+		/*
+		 * Pinned before it runs, so that its context and the
+		 * slabs it populates itself are first touched on its
+		 * own node.
+		 */
+		ret = pthread_attr_init(&attr);
+		if (ret == 0) {
+			ret = pthread_attr_setaffinity_np(&attr, size, cpus);
+			if (ret == 0)
+				ret = pthread_create(&s->tid, &attr, server, s);
+			pthread_attr_destroy(&attr);
+		}
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			ret = -1;
+			goto err;
+		}
+		s++;
+	}
+	ret = init_signal(p);
+	if (ret == -1)
+		goto err;
+	ret = init_timer(p);
+	if (ret == -1)
+		goto err;
+	CPU_FREE(cpus);
+	/* tell the previous process to let the listeners go */
+	if (p->inherit_fd != -1) {
+		if (write(p->inherit_fd, "", 1) != 1)
+			perror("write");
+		close(p->inherit_fd);
+	}
+	return 0;
+err:
+	if (ss != NULL) {
+		s = ss;
+		for (j = 0; j < i; j++) {
+			ret = pthread_cancel(s->tid);
+			if (ret) {
+				errno = ret;
+				perror("pthread_cancel");
+				/* ignore the error */
+			}
+			s++;
+		}
+		/* listeners not handed over to a server yet */
+		for (; s < ss + p->concurrent; s++) {
+			for (k = 0; k < p->nr_listeners; k++)
+				if (s->acceptors[k].sd != -1)
+					close(s->acceptors[k].sd);
+			if (s->evfd != -1)
+				close(s->evfd);
+		}
+		p->servers = NULL;
+		munmap(ss, p->concurrent*sizeof(struct server));
+	}
+	for (k = 0; k < nr_inherit; k++)
+		for (j = 0; j < nr_fds[k]; j++)
+			if (fds[k][j] != -1)
+				close(fds[k][j]);
+	if (cpus != NULL)
+		CPU_FREE(cpus);
+	free(p->cpus);
+	p->cpus = NULL;
+	term_cache(p->cache);
+	p->cache = NULL;
+	return -1;
+}
+
+static void term(const struct process *restrict p)
+{
+	struct server *s = p->servers;
+	int i, ret, *retp;
+
+	if (s == NULL)
+		return;
+	for (i = 0; i < p->concurrent; i++) {
+		if (s->tid == 0)
+			continue;
+		ret = pthread_kill(s->tid, 0);
+		if (ret) {
+			perror("pthread_kill");
+			continue;
+		}
+		ret = pthread_join(s->tid, (void **)&retp);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			/* ignore error */
+		}
+		if (*retp != EXIT_SUCCESS)
+			fprintf(stderr, "tid=%ld,status=%d\n", s->tid, *retp);
+		s++;
+	}
+	munmap(p->servers, p->concurrent*sizeof(struct server));
+	free(p->cpus);
+	term_cache(p->cache);
+}
+
+/*
+ * Hot reload.  The same command line, less the listener socket of an
+ * earlier reload, is exec'ed with the listeners sent over a socket
+ * pair.  Once the new process is up and tells so, the servers here
+ * drain and go away while the new ones accept from the very same
+ * listeners, so no connection is refused in between.  It returns 0
+ * once the new process took over, or -1 to keep on serving.
+ */
+static int reload(const struct process *p)
+{
+	char cbuf[CMSG_SPACE(SCHAR_MAX*sizeof(int))];
+	char opt[sizeof("--inherit-fd=")+11];
+	struct pollfd pfd;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char **argv, byte = 0;
+	int i, k, n, sd, ret, sv[2];
+	sigset_t mask;
+	pid_t pid;
+
+	argv = calloc(p->argc+2, sizeof(char *));
+	if (argv == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = n = 0; i < p->argc; i++) {
+		if (!strcmp(p->argv[i], "-I")
+		    || !strcmp(p->argv[i], "--inherit-fd")) {
+			i++;
+			continue;
+		}
+		if (!strncmp(p->argv[i], "-I", 2)
+		    || !strncmp(p->argv[i], "--inherit-fd=", 13))
+			continue;
+		argv[n++] = p->argv[i];
+	}
+	ret = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv);
+	if (ret == -1) {
+		perror("socketpair");
+		free(argv);
+		return -1;
+	}
+	snprintf(opt, sizeof(opt), "--inherit-fd=%d", sv[1]);
+	argv[n++] = opt;
+	argv[n] = NULL;
+	sigemptyset(&mask);
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		goto err;
+	} else if (pid == 0) {
+		/* the reload signals are blocked across exec */
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		if (fcntl(sv[1], F_SETFD, 0) == -1)
+			_exit(EXIT_FAILURE);
+		execvp(argv[0], argv);
+		perror("execvp");
+		_exit(EXIT_FAILURE);
+	}
+	close(sv[1]);
+	sv[1] = -1;
+	/* a message per listener, see recv_listeners() */
+	for (k = 0; k < p->nr_listeners; k++) {
+		memset(cbuf, 0, sizeof(cbuf));
+		byte = p->nr_listeners-1-k;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		for (i = n = 0; i < p->concurrent; i++) {
+			sd = p->servers[i].acceptors[k].sd;
+			if (sd != -1)
+				memcpy(CMSG_DATA(cmsg)+n++*sizeof(int), &sd,
+				       sizeof(int));
+		}
+		msg.msg_controllen = CMSG_SPACE(n*sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n*sizeof(int));
+		ret = sendmsg(sv[0], &msg, MSG_NOSIGNAL);
+		if (ret == -1) {
+			perror("sendmsg");
+			goto kill;
+		}
+	}
+	/* wait for the new process, or for it to die on start up */
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	do
+		ret = poll(&pfd, 1, RELOAD_WAIT);
+	while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		perror("poll");
+		goto kill;
+	} else if (ret == 0 || read(sv[0], &byte, 1) != 1) {
+		fprintf(stderr, "reload: new process did not start\n");
+		goto kill;
+	}
+	close(sv[0]);
+	free(argv);
+	for (i = 0; i < p->concurrent; i++)
+		if (eventfd_write(p->servers[i].evfd, 1) == -1)
+			perror("eventfd_write");
+	return 0;
+kill:
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+err:
+	close(sv[0]);
+	if (sv[1] != -1)
+		close(sv[1]);
+	free(argv);
+	return -1;
+}
+
+/*
+ * Address of a listener, with an empty host for any address.  A path
+ * with a leading @ is in the abstract namespace.
+ */
+static int set_addr(struct listener *l, int domain, const char *host,
+		    long port)
+{
+	memset(&l->addr, 0, sizeof(l->addr));
+	l->domain = domain;
+	switch (domain) {
+	case AF_INET:
+		l->addr.sin.sin_family = AF_INET;
+		l->addr.sin.sin_port = htons(port);
+		l->slen = sizeof(l->addr.sin);
+		if (*host && inet_pton(AF_INET, host, &l->addr.sin.sin_addr) != 1)
+			return -1;
+		break;
+	case AF_INET6:
+		l->addr.sin6.sin6_family = AF_INET6;
+		l->addr.sin6.sin6_port = htons(port);
+		l->slen = sizeof(l->addr.sin6);
+		if (*host && inet_pton(AF_INET6, host, &l->addr.sin6.sin6_addr) != 1)
+			return -1;
+		break;
+	case AF_UNIX:
+		if (*host == '\0' || strlen(host) >= sizeof(l->addr.sun.sun_path))
+			return -1;
+		l->addr.sun.sun_family = AF_UNIX;
+		strcpy(l->addr.sun.sun_path, host);
+		l->slen = offsetof(struct sockaddr_un, sun_path)+strlen(host)+1;
+		/* no trailing NUL in an abstract address */
+		if (host[0] == '@') {
+			l->addr.sun.sun_path[0] = '\0';
+			l->slen--;
+		}
+		return 0;
+	default:
+		return -1;
+	}
+	return port <= 0 || port >= USHRT_MAX ? -1 : 0;
+}
+
+/* --listen ADDR:PORT, [ADDR6]:PORT or PATH, and the options after it */
+static int parse_listen(struct listener *l, const char *arg)
+{
+	char buf[LISTEN_MAX], *host = buf, *port, *opt, *next, *end;
+	int domain = AF_INET;
+	long val, last;
+
+	if (strlen(arg) >= sizeof(buf))
+		return -1;
+	strcpy(buf, arg);
+	opt = strchr(buf, ',');
+	if (opt != NULL)
+		*opt++ = '\0';
+	if (buf[0] == '/' || buf[0] == '@') {
+		if (set_addr(l, AF_UNIX, buf, 0) == -1)
+			return -1;
+	} else {
+		if (buf[0] == '[') {
+			domain = AF_INET6;
+			host++;
+			port = strchr(host, ']');
+			if (port == NULL || port[1] != ':')
+				return -1;
+			*port = '\0';
+			port += 2;
+		} else if ((port = strrchr(buf, ':')) != NULL)
+			*port++ = '\0';
+		else {
+			port = buf;
+			host = "";
+		}
+		val = strtol(port, &end, 10);
+		if (end == port || *end)
+			return -1;
+		if (set_addr(l, domain, host, val) == -1)
+			return -1;
+	}
+	for (; opt != NULL; opt = next) {
+		next = strchr(opt, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (!strncmp(opt, "backlog=", 8)) {
+			val = strtol(opt+8, &end, 10);
+			if (end == opt+8 || *end || val <= 0 || val > UCHAR_MAX)
+				return -1;
+			l->backlog = val;
+		} else if (!strncmp(opt, "servers=", 8)) {
+			val = last = strtol(opt+8, &end, 10);
+			if (end != opt+8 && *end == '-')
+				last = strtol(end+1, &end, 10);
+			if (end == opt+8 || *end || val < 0 || last < val
+			    || last >= SCHAR_MAX)
+				return -1;
+			memset(l->servers+val, 1, last-val+1);
+			l->dedicated = 1;
+		} else
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Servers of the listeners, once -c is known.  The ones without
+ * servers= share every server not dedicated to another listener, or
+ * all of them when none is left.
+ */
+static int assign_servers(struct process *p)
+{
+	struct listener *l, *end = p->listeners + p->nr_listeners;
+	char dedicated[SCHAR_MAX] = {0};
+	int i, left = 0;
+
+	for (l = p->listeners; l < end; l++)
+		for (i = 0; l->dedicated && i < SCHAR_MAX; i++) {
+			if (!l->servers[i])
+				continue;
+			if (i >= p->concurrent)
+				return -1;
+			dedicated[i] = 1;
+		}
+	for (i = 0; i < p->concurrent; i++)
+		if (!dedicated[i])
+			left++;
+	for (l = p->listeners; l < end; l++)
+		for (i = 0; !l->dedicated && i < p->concurrent; i++)
+			l->servers[i] = !left || !dedicated[i];
+	return 0;
+}
+
+int main(int argc, char *const argv[])
+{
+	struct process *p = &proc;
+	sigset_t mask;
+	int ret, opt, sig;
+
+	p->concurrent = get_nprocs();
+	p->progname = argv[0];
+	p->argc = argc;
+	p->argv = argv;
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, p->opts, p->lopts, NULL)) != -1) {
+		long val;
+		switch (opt) {
+		case 'b':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > UCHAR_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->backlog = val;
+			break;
+		case 'c':
 			val = strtol(optarg, NULL, 10);
 			if (val <= 0 || val > SCHAR_MAX)
 				usage(p, stderr, EXIT_FAILURE);
 			p->concurrent = val;
 			break;
+		case 'C':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0)
+				usage(p, stderr, EXIT_FAILURE);
+			p->cache_size = val;
+			break;
 		case 't':
 			val = strtol(optarg, NULL, 10);
 			if (val < -1 || val > UINT_MAX)
@@ -394,12 +4654,107 @@ int main(int argc, char *const argv[])
 		case '6':
 			p->domain = AF_INET6;
 			break;
+		case 'U':
+			if (*optarg == '\0'
+			    || strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+				usage(p, stderr, EXIT_FAILURE);
+			p->domain = AF_UNIX;
+			p->path = optarg;
+			break;
 		case 'p':
 			val = strtol(optarg, NULL, 10);
 			if (val <= 0 || val >= USHRT_MAX)
 				usage(p, stderr, EXIT_FAILURE);
 			p->port = val;
 			break;
+		case 'l':
+			if (p->nr_listeners == NR_LISTENERS)
+				usage(p, stderr, EXIT_FAILURE);
+			ret = parse_listen(&p->listeners[p->nr_listeners++], optarg);
+			if (ret == -1)
+				usage(p, stderr, EXIT_FAILURE);
+			break;
+		case 'e':
+			if (!strcmp(optarg, "epoll"))
+				p->engine = ENGINE_EPOLL;
+			else if (!strcmp(optarg, "uring"))
+				p->engine = ENGINE_URING;
+			else
+				usage(p, stderr, EXIT_FAILURE);
+			break;
+		case 'H':
+		case 'i':
+		case 'k':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			if (opt == 'H')
+				p->header_timeout = val;
+			else if (opt == 'i')
+				p->idle_timeout = val;
+			else
+				p->keepalive_timeout = val;
+			break;
+		case 'A':
+			p->incoming_cpu = 1;
+			break;
+		case 'B':
+		case 'D':
+		case 'F':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			if (opt == 'B')
+				p->busy_poll = val;
+			else if (opt == 'D')
+				p->defer_accept = val;
+			else
+				p->fastopen = val;
+			break;
+		case 'I':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->inherit_fd = val;
+			break;
+		case 'a':
+		case 'm':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > USHRT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			if (opt == 'a')
+				p->admit_conns = val;
+			else
+				p->max_conns = val;
+			break;
+		case 'L':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->max_lag = val;
+			break;
+		case 'O':
+			for (val = 0; val < sizeof(overloads)/sizeof(*overloads); val++)
+				if (!strcmp(optarg, overloads[val]))
+					break;
+			if (val == sizeof(overloads)/sizeof(*overloads))
+				usage(p, stderr, EXIT_FAILURE);
+			p->overload = val;
+			break;
+		case 'P':
+			for (val = 0; val < sizeof(placements)/sizeof(*placements); val++)
+				if (!strcmp(optarg, placements[val]))
+					break;
+			if (val == sizeof(placements)/sizeof(*placements))
+				usage(p, stderr, EXIT_FAILURE);
+			p->placement = val;
+			break;
+		case 'r':
+			p->root = optarg;
+			break;
+		case 'S':
+			p->steer = 1;
+			break;
 		case 'h':
 			usage(p, stdout, EXIT_SUCCESS);
 			break;
@@ -409,12 +4764,34 @@ int main(int argc, char *const argv[])
 			break;
 		}
 	}
+	if (p->nr_listeners == 0) {
+		p->nr_listeners = 1;
+		ret = set_addr(&p->listeners[0], p->domain,
+			       p->domain == AF_UNIX ? p->path : "",
+			       (unsigned short)p->port);
+		if (ret == -1)
+			usage(p, stderr, EXIT_FAILURE);
+	}
+	if (assign_servers(p) == -1)
+		usage(p, stderr, EXIT_FAILURE);
+	/* the steering program picks out of a SO_REUSEPORT group */
+	for (opt = 0; p->steer && opt < p->nr_listeners; opt++)
+		if (p->listeners[opt].domain == AF_UNIX)
+			usage(p, stderr, EXIT_FAILURE);
+	if (p->admit_conns == 0 || p->admit_conns > p->max_conns)
+		p->admit_conns = p->max_conns;
 	ret = init(p);
 	if (ret == -1)
 		return 1;
-	while (1)
-		if (pause())
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	while (1) {
+		if (sigwait(&mask, &sig))
 			break;
+		if (reload(p) == 0)
+			break;
+	}
 	term(p);
 	return 0;
 }
@@ -0,0 +1,894 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sysinfo.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+
+#define NR_EVENTS	64
+#define NR_SWEEP	16	/* values in a sweep list */
+#define NR_INFLIGHT	256	/* pipelined requests per connection */
+#define RBUF_SIZE	16384
+#define REQ_MAX		512
+#define HIST_BITS	7	/* 2^7 sub-buckets, <1% value error */
+#define HIST_SUB	(1<<HIST_BITS)
+#define HIST_SHIFTS	40	/* up to 2^47 nsec, ~39 hours */
+#define NR_HIST		((HIST_SHIFTS+1)*HIST_SUB)
+#define START_WAIT	2000	/* server start up in msec */
+#define NR_SERVER_OPTS	8	/* extra httpd options */
+
+/*
+ * Log-linear histogram in nanoseconds, HDR style: values below
+ * 2*HIST_SUB are exact, and above that every power of two is split
+ * into HIST_SUB buckets.
+ */
+struct hist {
+	unsigned long		count;
+	unsigned long		max;
+	unsigned long		buckets[NR_HIST];
+};
+
+/* client connection */
+struct conn {
+	int			sd;
+	unsigned long		skip;		/* body to be skipped */
+	unsigned long		next;		/* next open loop send */
+	unsigned		head;		/* in-flight ring */
+	unsigned		tail;
+	unsigned		opos;		/* partially sent request */
+	unsigned		olen;
+	unsigned		rlen;
+	unsigned long		sent[NR_INFLIGHT];
+	char			obuf[REQ_MAX];
+	char			rbuf[RBUF_SIZE];
+};
+
+/* load generator thread */
+struct client {
+	const struct process	*p;
+	pthread_t		tid;
+	int			efd;
+	int			nr_conns;
+	struct conn		*conns;
+	unsigned long		start;
+	unsigned long		deadline;
+	unsigned long		interval;	/* open loop, per connection */
+	unsigned long		requests;
+	unsigned long		errors;
+	unsigned long		dropped;
+	struct hist		hist;
+};
+
+static struct process {
+	const char		*progname;
+	const char		*server;
+	const char		*engine;
+	const char		*root;
+	const char		*uri;
+	short			port;
+	const char		*path;		/* Unix domain socket */
+	int			new_conn;	/* a connection per request */
+	int			fastopen;
+	int			nr_server_opts;
+	char			*server_opts[NR_SERVER_OPTS];
+	int			threads;
+	int			duration;
+	unsigned long		rate;
+	int			nr_workers;
+	int			workers[NR_SWEEP];
+	int			nr_conns;
+	int			conns[NR_SWEEP];
+	int			reqlen;
+	char			req[REQ_MAX];
+	int			domain;
+	socklen_t		alen;
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	sin;
+		struct sockaddr_un	sun;
+	}			addr;
+	const char		*const opts;
+	const struct option	lopts[];
+} proc = {
+	.server		= "./httpd",
+	.engine		= NULL,
+	.root		= NULL,
+	.uri		= "/",
+	.port		= 1024,
+	.path		= NULL,
+	.new_conn	= 0,
+	.fastopen	= 0,
+	.nr_server_opts	= 0,
+	.threads	= 1,
+	.duration	= 1000,
+	.rate		= 0,
+	.nr_workers	= 1,
+	.workers	= {1},
+	.nr_conns	= 3,
+	.conns		= {1, 16, 64},
+	.opts		= "C:c:d:e:Fno:p:R:r:s:T:U:u:h",
+	.lopts		= {
+		{"connections",	required_argument,	0,	'C'},
+		{"concurrent",	required_argument,	0,	'c'},
+		{"duration",	required_argument,	0,	'd'},
+		{"engine",	required_argument,	0,	'e'},
+		{"fastopen",	no_argument,		0,	'F'},
+		{"new-conn",	no_argument,		0,	'n'},
+		{"server-opt",	required_argument,	0,	'o'},
+		{"port",	required_argument,	0,	'p'},
+		{"rate",	required_argument,	0,	'R'},
+		{"root",	required_argument,	0,	'r'},
+		{"server",	required_argument,	0,	's'},
+		{"threads",	required_argument,	0,	'T'},
+		{"unix",	required_argument,	0,	'U'},
+		{"uri",		required_argument,	0,	'u'},
+		{"help",	no_argument,		0,	'h'},
+		{NULL, 0, NULL, 0}, /* sentry */
+	},
+};
+
+static void usage(const struct process *restrict p, FILE *s, int status)
+{
+	const struct option *o;
+	fprintf(s, "usage: %s [-%s]\n", p->progname, p->opts);
+	fprintf(s, "options:\n");
+	for (o = p->lopts; o->name; o++) {
+		fprintf(s, "\t-%c,--%s:", o->val, o->name);
+		switch (o->val) {
+		case 'C':
+			fprintf(s, "\tComma separated client connections to sweep (default: 1,16,64)\n");
+			break;
+		case 'c':
+			fprintf(s, "\tComma separated httpd -c values to sweep (default: 1)\n");
+			break;
+		case 'd':
+			fprintf(s, "\tDuration of each run in milliseconds (default: %d)\n",
+				p->duration);
+			break;
+		case 'e':
+			fprintf(s, "\t\thttpd event engine (default: httpd default)\n");
+			break;
+		case 'F':
+			fprintf(s, "\t\tTCP Fast Open the new connections, see -n\n");
+			break;
+		case 'n':
+			fprintf(s, "\t\tNew connection for every request, closed loop only\n");
+			break;
+		case 'o':
+			fprintf(s, "\tExtra httpd option, may be repeated (e.g. -o --defer-accept=1)\n");
+			break;
+		case 'p':
+			fprintf(s, "\t\thttpd port on the loopback (default: %d)\n",
+				p->port);
+			break;
+		case 'R':
+			fprintf(s, "\t\tOpen loop requests per second, 0 for closed loop (default: %lu)\n",
+				p->rate);
+			break;
+		case 'r':
+			fprintf(s, "\t\thttpd document root (default: none)\n");
+			break;
+		case 's':
+			fprintf(s, "\t\thttpd to benchmark (default: %s)\n",
+				p->server);
+			break;
+		case 'T':
+			fprintf(s, "\t\tLoad generator threads (default: %d)\n",
+				p->threads);
+			break;
+		case 'U':
+			fprintf(s, "\t\thttpd Unix domain socket path, @name for abstract\n");
+			break;
+		case 'u':
+			fprintf(s, "\t\tRequested URI (default: %s)\n", p->uri);
+			break;
+		case 'h':
+			fprintf(s, "\t\tdisplay this message and exit\n");
+			break;
+		default:
+			fprintf(s, "\t\t%s option\n", o->name);
+			break;
+		}
+	}
+	exit(status);
+}
+
+static unsigned long now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long val)
+{
+	int shift = 0;
+
+	if (val >= 2*HIST_SUB)
+		shift = 63-__builtin_clzl(val)-HIST_BITS;
+	if (shift > HIST_SHIFTS)
+		return NR_HIST-1;
+	return shift ? shift*HIST_SUB + (val>>shift) : val;
+}
+
+/* lowest value of the bucket */
+static unsigned long hist_value(int i)
+{
+	int shift = i < 2*HIST_SUB ? 0 : i/HIST_SUB-1;
+
+	return (unsigned long)(i-shift*HIST_SUB) << shift;
+}
+
+static void hist_add(struct hist *h, unsigned long val)
+{
+	h->buckets[hist_index(val)]++;
+	h->count++;
+	if (val > h->max)
+		h->max = val;
+}
+
+static void hist_merge(struct hist *h, const struct hist *o)
+{
+	int i;
+
+	for (i = 0; i < NR_HIST; i++)
+		h->buckets[i] += o->buckets[i];
+	h->count += o->count;
+	if (o->max > h->max)
+		h->max = o->max;
+}
+
+static unsigned long hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long want, sum = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	want = h->count*pct/100;
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < NR_HIST; i++) {
+		sum += h->buckets[i];
+		if (sum >= want)
+			return hist_value(i);
+	}
+	return h->max;
+}
+
+static int parse_list(const char *arg, int *list, int max)
+{
+	char *end;
+	long val;
+	int nr = 0;
+
+	do {
+		val = strtol(arg, &end, 10);
+		if (end == arg || val <= 0 || val > SHRT_MAX || nr == max)
+			return -1;
+		list[nr++] = val;
+		arg = end+1;
+	} while (*end == ',');
+	return *end ? -1 : nr;
+}
+
+/*
+ * The server is ready once it answers a request, as a connection
+ * could still be accepted by the listener of the previous one going
+ * away in the same SO_REUSEPORT group.
+ */
+static int wait_server(const struct process *p, pid_t pid)
+{
+	struct timeval tv = {.tv_usec = 100000};
+	char buf[64];
+	int i, sd, ret;
+
+	for (i = 0; i < START_WAIT/10; i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "%s: exited on start up\n", p->server);
+			return -1;
+		}
+		sd = socket(p->domain, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (sd == -1) {
+			perror("socket");
+			return -1;
+		}
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		ret = connect(sd, &p->addr.sa, p->alen);
+		if (ret == 0)
+			ret = send(sd, p->req, p->reqlen, MSG_NOSIGNAL);
+		if (ret > 0)
+			ret = recv(sd, buf, sizeof(buf), 0);
+		close(sd);
+		if (ret > 0)
+			return 0;
+		usleep(10000);
+	}
+	if (p->path)
+		fprintf(stderr, "%s: not listening on %s\n", p->server,
+			p->path);
+	else
+		fprintf(stderr, "%s: not listening on port %d\n", p->server,
+			p->port);
+	return -1;
+}
+
+static pid_t start_server(const struct process *p, int workers)
+{
+	char concurrent[16], port[16];
+	char *argv[16+NR_SERVER_OPTS];
+	int i, argc = 0;
+	pid_t pid;
+
+	snprintf(concurrent, sizeof(concurrent), "%d", workers);
+	snprintf(port, sizeof(port), "%d", p->port);
+	argv[argc++] = (char *)p->server;
+	argv[argc++] = "-c";
+	argv[argc++] = concurrent;
+	argv[argc++] = "-b";
+	argv[argc++] = "255";
+	if (p->path) {
+		argv[argc++] = "-U";
+		argv[argc++] = (char *)p->path;
+	} else {
+		argv[argc++] = "-p";
+		argv[argc++] = port;
+	}
+	if (p->engine) {
+		argv[argc++] = "-e";
+		argv[argc++] = (char *)p->engine;
+	}
+	if (p->root) {
+		argv[argc++] = "-r";
+		argv[argc++] = (char *)p->root;
+	}
+	for (i = 0; i < p->nr_server_opts; i++)
+		argv[argc++] = p->server_opts[i];
+	argv[argc] = NULL;
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		execv(p->server, argv);
+		perror(p->server);
+		_exit(EXIT_FAILURE);
+	}
+	if (wait_server(p, pid) == -1) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+static void stop_server(pid_t pid)
+{
+	if (kill(pid, SIGTERM) == -1)
+		perror("kill");
+	if (waitpid(pid, NULL, 0) == -1)
+		perror("waitpid");
+}
+
+static int open_conn(struct client *ctx, struct conn *c)
+{
+	const struct process *const p = ctx->p;
+	struct epoll_event ev = {
+		.events		= EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+		.data.ptr	= c,
+	};
+	int opt = 1;
+
+	c->sd = socket(p->domain, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (c->sd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (p->domain == AF_INET
+	    && setsockopt(c->sd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+		perror("setsockopt(TCP_NODELAY)");
+		goto err;
+	}
+	/* the request goes out with the SYN, once there is a cookie */
+	if (p->fastopen && setsockopt(c->sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+				      &opt, sizeof(opt))) {
+		perror("setsockopt(TCP_FASTOPEN_CONNECT)");
+		goto err;
+	}
+	/*
+	 * Blocking connect to not overflow the listening backlog, but
+	 * for a connection per request, where the handshake is part of
+	 * the latency and the request is sent as soon as it is done.
+	 */
+	if (p->new_conn && fcntl(c->sd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("fcntl");
+		goto err;
+	}
+	if (connect(c->sd, &p->addr.sa, p->alen)
+	    && errno != EINPROGRESS) {
+		perror("connect");
+		goto err;
+	}
+	if (!p->new_conn && fcntl(c->sd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("fcntl");
+		goto err;
+	}
+	if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, c->sd, &ev)) {
+		perror("epoll_ctl");
+		goto err;
+	}
+	c->head = c->tail = c->opos = c->olen = c->rlen = 0;
+	c->skip = 0;
+	return 0;
+err:
+	close(c->sd);
+	c->sd = -1;
+	return -1;
+}
+
+static void close_conn(struct client *ctx, struct conn *c)
+{
+	if (c->sd == -1)
+		return;
+	close(c->sd);
+	c->sd = -1;
+}
+
+static int flush_conn(struct client *ctx, struct conn *c)
+{
+	ssize_t len;
+
+	while (c->opos < c->olen) {
+		len = send(c->sd, c->obuf+c->opos, c->olen-c->opos,
+			   MSG_NOSIGNAL);
+		if (len == -1) {
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		c->opos += len;
+	}
+	c->opos = c->olen = 0;
+	return 0;
+}
+
+/* queues a request intended to be sent at the time */
+static int send_req(struct client *ctx, struct conn *c, unsigned long time)
+{
+	const struct process *const p = ctx->p;
+
+	if (c->tail-c->head == NR_INFLIGHT
+	    || c->olen+p->reqlen > sizeof(c->obuf)) {
+		ctx->dropped++;
+		return 0;
+	}
+	c->sent[c->tail++%NR_INFLIGHT] = time;
+	memcpy(c->obuf+c->olen, p->req, p->reqlen);
+	c->olen += p->reqlen;
+	return flush_conn(ctx, c);
+}
+
+/*
+ * Consumes the complete responses in the receive buffer, returns the
+ * number of them or -1 on a malformed one.
+ */
+static int scan_conn(struct client *ctx, struct conn *c, unsigned long now)
+{
+	char *end, *cl;
+	unsigned len;
+	int nr = 0;
+
+	while (c->rlen) {
+		if (c->skip) {
+			len = c->skip < c->rlen ? c->skip : c->rlen;
+			c->skip -= len;
+			c->rlen -= len;
+			memmove(c->rbuf, c->rbuf+len, c->rlen);
+			if (c->skip)
+				break;
+		} else {
+			c->rbuf[c->rlen] = '\0';
+			end = strstr(c->rbuf, "\r\n\r\n");
+			if (end == NULL) {
+				if (c->rlen == sizeof(c->rbuf)-1)
+					return -1;
+				break;
+			}
+			cl = strcasestr(c->rbuf, "\r\nContent-Length:");
+			c->skip = cl && cl < end ? strtoul(cl+17, NULL, 10) : 0;
+			len = end+4-c->rbuf;
+			c->rlen -= len;
+			memmove(c->rbuf, c->rbuf+len, c->rlen);
+			if (c->skip)
+				continue;
+		}
+		if (c->head == c->tail)
+			return -1;
+		if (now < ctx->deadline) {
+			hist_add(&ctx->hist, now-c->sent[c->head%NR_INFLIGHT]);
+			ctx->requests++;
+		}
+		c->head++;
+		nr++;
+	}
+	return nr;
+}
+
+/* a connection per request, the next one starts with its handshake */
+static int reopen_conn(struct client *ctx, struct conn *c, unsigned long now)
+{
+	close_conn(ctx, c);
+	if (open_conn(ctx, c) == -1)
+		return -1;
+	return send_req(ctx, c, now);
+}
+
+static int recv_conn(struct client *ctx, struct conn *c)
+{
+	unsigned long now;
+	ssize_t len;
+	int i, nr;
+
+	while (1) {
+		len = recv(c->sd, c->rbuf+c->rlen, sizeof(c->rbuf)-1-c->rlen,
+			   0);
+		if (len == -1) {
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		} else if (len == 0)
+			return -1;
+		c->rlen += len;
+		now = now_nsec();
+		nr = scan_conn(ctx, c, now);
+		if (nr == -1)
+			return -1;
+		if (ctx->p->new_conn && nr) {
+			if (now >= ctx->deadline) {
+				close_conn(ctx, c);
+				return 0;
+			}
+			return reopen_conn(ctx, c, now);
+		}
+		/* closed loop sends the next one right away */
+		if (ctx->interval == 0 && now < ctx->deadline)
+			for (i = 0; i < nr; i++)
+				if (send_req(ctx, c, now) == -1)
+					return -1;
+	}
+}
+
+/* open loop requests due, returns the time of the next one */
+static unsigned long schedule(struct client *ctx, unsigned long now)
+{
+	unsigned long next = ctx->deadline;
+	struct conn *c;
+	int i;
+
+	for (i = 0; i < ctx->nr_conns; i++) {
+		c = &ctx->conns[i];
+		if (c->sd == -1)
+			continue;
+		/* latency counts from the intended, not the actual, time */
+		while (c->next <= now) {
+			if (send_req(ctx, c, c->next) == -1) {
+				ctx->errors++;
+				close_conn(ctx, c);
+				break;
+			}
+			c->next += ctx->interval;
+		}
+		if (c->sd != -1 && c->next < next)
+			next = c->next;
+	}
+	return next;
+}
+
+static void *client(void *arg)
+{
+	struct client *ctx = arg;
+	struct epoll_event events[NR_EVENTS];
+	unsigned long now, next;
+	struct timespec ts;
+	struct conn *c;
+	int i, nr;
+
+	now = now_nsec();
+	for (i = 0; i < ctx->nr_conns; i++) {
+		c = &ctx->conns[i];
+		if (ctx->interval)
+			c->next = ctx->start + ctx->interval*i/ctx->nr_conns;
+		else if (send_req(ctx, c, now) == -1) {
+			ctx->errors++;
+			close_conn(ctx, c);
+		}
+	}
+	while ((now = now_nsec()) < ctx->deadline) {
+		/* nanosecond timeout not to send the open loop ones late */
+		next = ctx->interval ? schedule(ctx, now) : ctx->deadline;
+		next = next > now ? next-now : 0;
+		ts.tv_sec = next/1000000000;
+		ts.tv_nsec = next%1000000000;
+		nr = epoll_pwait2(ctx->efd, events, NR_EVENTS, &ts, NULL);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_pwait2");
+			break;
+		}
+		for (i = 0; i < nr; i++) {
+			c = events[i].data.ptr;
+			if (c->sd == -1)
+				continue;
+			if (flush_conn(ctx, c) == -1 || recv_conn(ctx, c) == -1
+			    || events[i].events&(EPOLLERR|EPOLLHUP)) {
+				ctx->errors++;
+				close_conn(ctx, c);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void term_clients(struct client *clients, int nr)
+{
+	struct client *ctx;
+	int i;
+
+	for (ctx = clients; ctx < clients+nr; ctx++) {
+		if (ctx->conns) {
+			for (i = 0; i < ctx->nr_conns; i++)
+				close_conn(ctx, &ctx->conns[i]);
+			free(ctx->conns);
+		}
+		if (ctx->efd != -1)
+			close(ctx->efd);
+	}
+	free(clients);
+}
+
+/* one run with the connections spread over the threads */
+static int run(const struct process *p, int workers, int conns)
+{
+	int i, j, ret = -1, nr = p->threads < conns ? p->threads : conns;
+	unsigned long requests = 0, errors = 0, dropped = 0, start;
+	struct client *clients, *ctx;
+	struct hist *hist;
+	double sec;
+
+	clients = calloc(nr, sizeof(struct client));
+	hist = calloc(1, sizeof(struct hist));
+	if (clients == NULL || hist == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	for (i = 0; i < nr; i++)
+		clients[i].efd = -1;
+	for (i = 0; i < nr; i++) {
+		ctx = &clients[i];
+		ctx->p = p;
+		ctx->nr_conns = conns/nr + (i < conns%nr);
+		ctx->efd = epoll_create1(EPOLL_CLOEXEC);
+		if (ctx->efd == -1) {
+			perror("epoll_create1");
+			goto out;
+		}
+		ctx->conns = calloc(ctx->nr_conns, sizeof(struct conn));
+		if (ctx->conns == NULL) {
+			perror("calloc");
+			goto out;
+		}
+		for (j = 0; j < ctx->nr_conns; j++)
+			ctx->conns[j].sd = -1;
+		for (j = 0; j < ctx->nr_conns; j++)
+			if (open_conn(ctx, &ctx->conns[j]) == -1)
+				goto out;
+		if (p->rate)
+			ctx->interval = 1000000000UL*conns/p->rate;
+	}
+	start = now_nsec();
+	for (i = 0; i < nr; i++) {
+		ctx = &clients[i];
+		ctx->start = start;
+		ctx->deadline = start + p->duration*1000000UL;
+		ret = pthread_create(&ctx->tid, NULL, client, ctx);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			nr = i;
+			ret = -1;
+			break;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		ctx = &clients[i];
+		pthread_join(ctx->tid, NULL);
+		hist_merge(hist, &ctx->hist);
+		requests += ctx->requests;
+		errors += ctx->errors;
+		dropped += ctx->dropped;
+	}
+	if (ret == -1)
+		goto out;
+	sec = p->duration/1000.0;
+	printf("%7d %7d %10lu %10.0f %9.1f %9.1f %9.1f %9.1f %7lu %7lu\n",
+	       workers, conns, requests, requests/sec,
+	       hist_percentile(hist, 50)/1000.0,
+	       hist_percentile(hist, 99)/1000.0,
+	       hist_percentile(hist, 99.9)/1000.0, hist->max/1000.0,
+	       errors, dropped);
+	fflush(stdout);
+	ret = 0;
+out:
+	if (clients)
+		term_clients(clients, nr);
+	if (hist)
+		free(hist);
+	return ret;
+}
+
+static int bench(struct process *p)
+{
+	int i, j, ret = 0;
+	pid_t pid;
+
+	p->reqlen = snprintf(p->req, sizeof(p->req),
+			     "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n",
+			     p->uri, p->new_conn ? "Connection: close\r\n" : "");
+	if (p->reqlen >= sizeof(p->req)) {
+		fprintf(stderr, "%s: too long URI\n", p->uri);
+		return -1;
+	}
+	if (p->path) {
+		/* a leading @ is the abstract namespace, as for httpd */
+		p->domain = AF_UNIX;
+		p->addr.sun.sun_family = AF_UNIX;
+		strcpy(p->addr.sun.sun_path, p->path);
+		p->alen = offsetof(struct sockaddr_un, sun_path)
+			  + strlen(p->path) + 1;
+		if (p->path[0] == '@') {
+			p->addr.sun.sun_path[0] = '\0';
+			p->alen--;
+		}
+	} else {
+		p->domain = AF_INET;
+		p->addr.sin.sin_family = AF_INET;
+		p->addr.sin.sin_port = htons(p->port);
+		p->addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		p->alen = sizeof(p->addr.sin);
+	}
+	printf("%s loop, %d thread(s), %d msec per run, latency in usec%s%s%s\n",
+	       p->rate ? "open" : "closed", p->threads, p->duration,
+	       p->new_conn ? ", connection per request" : "",
+	       p->fastopen ? ", fast open" : "",
+	       p->path ? ", unix socket" : "");
+	printf("%7s %7s %10s %10s %9s %9s %9s %9s %7s %7s\n", "workers",
+	       "conns", "requests", "rps", "p50", "p99", "p99.9", "max",
+	       "errors", "dropped");
+	for (i = 0; i < p->nr_workers; i++) {
+		pid = start_server(p, p->workers[i]);
+		if (pid == -1)
+			return -1;
+		for (j = 0; j < p->nr_conns && ret == 0; j++)
+			ret = run(p, p->workers[i], p->conns[j]);
+		stop_server(pid);
+		if (ret == -1)
+			break;
+	}
+	return ret;
+}
+
+int main(int argc, char *const argv[])
+{
+	struct process *p = &proc;
+	int ret, opt;
+
+	p->threads = get_nprocs();
+	p->progname = argv[0];
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, p->opts, p->lopts, NULL)) != -1) {
+		long val;
+		switch (opt) {
+		case 'C':
+			ret = parse_list(optarg, p->conns, NR_SWEEP);
+			if (ret == -1)
+				usage(p, stderr, EXIT_FAILURE);
+			p->nr_conns = ret;
+			break;
+		case 'c':
+			ret = parse_list(optarg, p->workers, NR_SWEEP);
+			if (ret == -1)
+				usage(p, stderr, EXIT_FAILURE);
+			p->nr_workers = ret;
+			break;
+		case 'd':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->duration = val;
+			break;
+		case 'e':
+			p->engine = optarg;
+			break;
+		case 'F':
+			p->fastopen = 1;
+			break;
+		case 'n':
+			p->new_conn = 1;
+			break;
+		case 'o':
+			if (p->nr_server_opts == NR_SERVER_OPTS)
+				usage(p, stderr, EXIT_FAILURE);
+			p->server_opts[p->nr_server_opts++] = optarg;
+			break;
+		case 'p':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val >= USHRT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->port = val;
+			break;
+		case 'R':
+			val = strtol(optarg, NULL, 10);
+			if (val < 0)
+				usage(p, stderr, EXIT_FAILURE);
+			p->rate = val;
+			break;
+		case 'r':
+			p->root = optarg;
+			break;
+		case 's':
+			p->server = optarg;
+			break;
+		case 'T':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > SHRT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->threads = val;
+			break;
+		case 'U':
+			if (strlen(optarg) >= sizeof(p->addr.sun.sun_path))
+				usage(p, stderr, EXIT_FAILURE);
+			p->path = optarg;
+			break;
+		case 'u':
+			p->uri = optarg;
+			break;
+		case 'h':
+			usage(p, stdout, EXIT_SUCCESS);
+			break;
+		case '?':
+		default:
+			usage(p, stderr, EXIT_FAILURE);
+			break;
+		}
+	}
+	/* the open loop keeps a connection for the requests in flight */
+	if (p->new_conn && p->rate)
+		usage(p, stderr, EXIT_FAILURE);
+	/* fast open is TCP only */
+	if (p->fastopen && p->path)
+		usage(p, stderr, EXIT_FAILURE);
+	ret = bench(p);
+	if (ret == -1)
+		return 1;
+	return 0;
+}
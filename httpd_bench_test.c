@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int main(void)
+{
+	char *const target = realpath("./httpd_bench", NULL);
+	const struct test {
+		char	*name;
+		char	*const argv[16];
+		int	want;
+	} *t, tests[] = {
+		{
+			.name	= "-h option",
+			.argv	= {target, "-h", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "closed loop sweep on port 1024",
+			.argv	= {target, "-c", "1,2", "-C", "1,4", "-T", "2", "-d", "100", "-p", "1024", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "open loop on port 1024",
+			.argv	= {target, "-C", "4", "--rate=1000", "-d", "100", "-p", "1024", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "io_uring engine on port 1024",
+			.argv	= {target, "-C", "4", "-e", "uring", "-d", "100", "-p", "1024", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "connection per request on port 1024",
+			.argv	= {target, "-C", "4", "-n", "-d", "100", "-p", "1024", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "fast open with deferred accept on port 1024",
+			.argv	= {target, "-C", "4", "-n", "-F", "-o", "--fastopen=64", "-o", "--defer-accept=1", "-d", "100", "-p", "1024", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "unix domain socket",
+			.argv	= {target, "-C", "1,4", "-U", "@httpd_bench_test", "-d", "100", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "fast open over unix domain socket",
+			.argv	= {target, "-F", "-U", "@httpd_bench_test", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "connection per request in open loop",
+			.argv	= {target, "-n", "--rate=1000", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "zero connections",
+			.argv	= {target, "-C", "0", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "malformed worker list",
+			.argv	= {target, "-c", "1,,2", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "non-existent server",
+			.argv	= {target, "-s", "/no/such/httpd", "-d", "100", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{ .name = NULL },
+	};
+	int ret = 0;
+
+	for (t = tests; t->name; t++) {
+		int status;
+		pid_t pid;
+
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			ret = -1;
+			break;
+		} else if (pid == 0) {
+			/* child */
+			ret = execv(target, t->argv);
+			if (ret == -1) {
+				perror("execv");
+				break;
+			}
+			/* not reach */
+		}
+		/* parent */
+		ret = waitpid(pid, &status, 0);
+		if (ret == -1) {
+			perror("waitpid");
+			break;
+		}
+		ret = -1;
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "%s: unexpected signal(%s)\n",
+				t->name, strsignal(WTERMSIG(status)));
+			break;
+		}
+		if (!WIFEXITED(status)) {
+			fprintf(stderr, "%s: unexpected exit\n", t->name);
+			break;
+		}
+		if (WEXITSTATUS(status) != t->want) {
+			fprintf(stderr, "%s: unexpected exit status:\n\t- want: %d\n\t-  got: %d\n",
+				t->name, t->want, WEXITSTATUS(status));
+			break;
+		}
+		ret = 0;
+	}
+	if (target)
+		free(target);
+	if (ret)
+		return 1;
+	return 0;
+}
@@ -3,15 +3,647 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT		1026		/* exchange tests */
+#define RESP_SIZE	(1<<20)
+
+/* the cached variants, as httpd picks its compressors */
+#if __has_include(<zlib.h>)
+#define GZIP_HEADER	"Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+#else
+#define GZIP_HEADER	"Content-Length: 4096\r\n"
+#endif
+#if __has_include(<brotli/encode.h>)
+#define BR_HEADER	"Content-Encoding: br\r\nVary: Accept-Encoding\r\n"
+#else
+#define BR_HEADER	GZIP_HEADER
+#endif
+
+/* the document root of the exchange tests */
+static const struct file {
+	const char	*name;
+	size_t		size;		/* filled up with the pattern */
+	const char	*data;
+} files[] = {
+	{.name = "index.html",	.data = "hello, world\n"},
+	{.name = "digits.txt",	.data = "0123456789"},
+	{.name = "text.html",	.size = 4096,	.data = "<p>hello, world</p>\n"},
+	{.name = "large.txt",	.size = 200000,	.data = "0123456789abcdef"},
+	{.name = NULL}, /* sentry */
+};
+
+/*
+ * A request and response exchange with a running server.  The request
+ * goes out in as many writes as there are strings, each one a format
+ * string taking the ETag of digits.txt, and the response is read up to
+ * the connection close.
+ */
+struct exchange {
+	char	*name;
+	char	*const argv[16];
+	char	*req[8];
+	size_t	pad;		/* filler header bytes after the first write */
+	int	reload;		/* SIGHUP in between two connections */
+	char	*want[16];	/* in the response, in this order */
+};
+
+static int make_root(const char *root)
+{
+	const struct file *f;
+	char path[PATH_MAX];
+	size_t len, n;
+	int fd, ret;
+
+	for (f = files; f->name; f++) {
+		snprintf(path, sizeof(path), "%s/%s", root, f->name);
+		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd == -1) {
+			perror(path);
+			return -1;
+		}
+		len = f->size ? f->size : strlen(f->data);
+		for (ret = 0; len && ret != -1; len -= n) {
+			n = strlen(f->data) < len ? strlen(f->data) : len;
+			ret = write(fd, f->data, n);
+		}
+		if (ret == -1)
+			perror("write");
+		if (close(fd) || ret == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void remove_root(const char *root)
+{
+	const struct file *f;
+	char path[PATH_MAX];
+
+	for (f = files; f->name; f++) {
+		snprintf(path, sizeof(path), "%s/%s", root, f->name);
+		unlink(path);
+	}
+	if (rmdir(root))
+		perror(root);
+}
+
+/* same ETag as the server's, see file_validators() */
+static int file_etag(const char *root, const char *name, char *etag,
+		     size_t size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	if (stat(path, &st)) {
+		perror(path);
+		return -1;
+	}
+	snprintf(etag, size, "\"%lx-%llx-%llx\"",
+		 (unsigned long)st.st_ino, (unsigned long long)st.st_size,
+		 (unsigned long long)st.st_mtim.tv_sec*1000000000ULL
+		 + st.st_mtim.tv_nsec);
+	return 0;
+}
+
+/* retried while the server is starting up */
+static int connect_server(void)
+{
+	struct sockaddr_in sin = {
+		.sin_family		= AF_INET,
+		.sin_port		= htons(PORT),
+		.sin_addr.s_addr	= htonl(INADDR_LOOPBACK),
+	};
+	const struct timeval tv = {.tv_sec = 3};
+	int sd, i;
+
+	for (i = 0; i < 300; i++) {
+		sd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sd == -1) {
+			perror("socket");
+			return -1;
+		}
+		if (connect(sd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+			break;
+		close(sd);
+		sd = -1;
+		if (errno != ECONNREFUSED) {
+			perror("connect");
+			return -1;
+		}
+		usleep(10000);
+	}
+	if (sd == -1) {
+		fprintf(stderr, "connect: server not up\n");
+		return -1;
+	}
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		perror("setsockopt(SO_RCVTIMEO)");
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+static int write_all(int sd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (; len; buf += ret, len -= ret) {
+		ret = write(sd, buf, len);
+		if (ret == -1) {
+			perror("write");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* one connection, the response is appended to resp */
+static ssize_t talk(const struct exchange *x, const char *etag, char *resp,
+		    size_t size)
+{
+	char req[1024], *pad = NULL;
+	ssize_t ret, len = 0;
+	int sd, i;
+
+	sd = connect_server();
+	if (sd == -1)
+		return -1;
+	for (i = 0; x->req[i]; i++) {
+		snprintf(req, sizeof(req), x->req[i], etag);
+		if (write_all(sd, req, strlen(req)))
+			goto err;
+		if (i == 0 && x->pad) {
+			pad = malloc(x->pad);
+			if (pad == NULL) {
+				perror("malloc");
+				goto err;
+			}
+			memcpy(pad, "X-Pad: ", 7);
+			memset(pad+7, 'a', x->pad-9);
+			memcpy(pad+x->pad-2, "\r\n", 2);
+			if (write_all(sd, pad, x->pad))
+				goto err;
+		}
+		usleep(20000);
+	}
+	while ((ret = read(sd, resp+len, size-len)) > 0)
+		len += ret;
+	if (ret == -1) {
+		perror("read");
+		goto err;
+	}
+	if (len == size) {
+		fprintf(stderr, "%s: response too large\n", x->name);
+		goto err;
+	}
+	free(pad);
+	close(sd);
+	return len;
+err:
+	free(pad);
+	close(sd);
+	return -1;
+}
+
+static int wait_exit(const char *name, pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: server did not exit cleanly\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_exchange(const char *target, const struct exchange *x,
+			const char *etag, char *resp)
+{
+	const char *ptr = resp, *found;
+	ssize_t len, ret;
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		execv(target, x->argv);
+		perror("execv");
+		exit(EXIT_FAILURE);
+	}
+	len = talk(x, etag, resp, RESP_SIZE);
+	if (len != -1 && x->reload) {
+		/*
+		 * The new process takes over the listener, it is our child
+		 * as the subreaper once the old one exits, and goes away
+		 * with its own -t timeout.
+		 */
+		if (kill(pid, SIGHUP) || wait_exit(x->name, pid))
+			len = -1;
+		pid = -1;
+		ret = len == -1 ? -1 : talk(x, etag, resp+len, RESP_SIZE-len);
+		if (wait_exit(x->name, -1) || ret == -1)
+			return -1;
+		len += ret;
+	}
+	if (pid != -1) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	if (len == -1)
+		return -1;
+	if (x->want[0] == NULL && len) {
+		fprintf(stderr, "%s: unexpected response:\n%.*s\n", x->name,
+			(int)len, resp);
+		return -1;
+	}
+	for (i = 0; x->want[i]; i++) {
+		found = memmem(ptr, resp+len-ptr, x->want[i], strlen(x->want[i]));
+		if (found == NULL) {
+			fprintf(stderr, "%s: no '%s' in the response:\n%.*s\n",
+				x->name, x->want[i], (int)len, resp);
+			return -1;
+		}
+		ptr = found+strlen(x->want[i]);
+	}
+	return 0;
+}
+
+/* requests against a running server */
+static int test_exchanges(char *target)
+{
+	char root[] = "/tmp/httpd_test.XXXXXX";
+	const struct exchange *x, exchanges[] = {
+		{
+			.name	= "pipelined requests",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 200 OK\r\n", "Content-Length: 13\r\n",
+				"Connection: keep-alive\r\n\r\nhello, world\n",
+				"HTTP/1.1 200 OK\r\n", "Content-Length: 10\r\n",
+				"Connection: close\r\n\r\n0123456789",
+			},
+		},
+		{
+			.name	= "request split across writes",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GE", "T /digits.txt HT", "TP/1.1\r\nHo",
+				"st: localhost\r", "\nConnection: close\r\n",
+				"\r", "\n",
+			},
+			.want	= {
+				"HTTP/1.1 200 OK\r\n", "Content-Length: 10\r\n",
+				"Connection: close\r\n\r\n0123456789",
+			},
+		},
+		{
+			.name	= "oversized request header",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {"GET / HTTP/1.1\r\n"},
+			.pad	= 16384-16,	/* up to the end of RBUF_SIZE */
+			.want	= {
+				"HTTP/1.1 431 Request Header Fields Too Large\r\n",
+				"Connection: close\r\n",
+			},
+		},
+		{
+			.name	= "keep-alive then close",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n\r\n",
+				"GET / HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"Connection: keep-alive\r\n\r\n0123456789",
+				"Connection: close\r\n\r\nhello, world\n",
+			},
+		},
+		{
+			.name	= "missing file",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /missing.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 404 Not Found\r\n",
+				"Connection: close\r\n\r\n404 Not Found\n",
+			},
+		},
+		{
+			.name	= "absolute path",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET //etc/passwd HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {"HTTP/1.1 404 Not Found\r\n"},
+		},
+		{
+			.name	= "encoded absolute path",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /%%2Fetc/passwd HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {"HTTP/1.1 404 Not Found\r\n"},
+		},
+		{
+			.name	= "path out of the document root",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /../ HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {"HTTP/1.1 404 Not Found\r\n"},
+		},
+		{
+			.name	= "header timeout",
+			.argv	= {target, "-c", "1", "-r", root, "-H", "200", "-p", "1026", NULL},
+			.req	= {"GET / HTTP/1.1\r\nHost: localhost\r\n"},
+			.want	= {NULL}, /* closed without a response */
+		},
+		{
+			.name	= "first and last byte range",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=2-5\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 206 Partial Content\r\n",
+				"Content-Length: 4\r\n",
+				"Content-Range: bytes 2-5/10\r\n",
+				"\r\n\r\n2345",
+			},
+		},
+		{
+			.name	= "suffix byte range",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=-3\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 206 Partial Content\r\n",
+				"Content-Length: 3\r\n",
+				"Content-Range: bytes 7-9/10\r\n",
+				"\r\n\r\n789",
+			},
+		},
+		{
+			.name	= "open ended byte range",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=8-\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 206 Partial Content\r\n",
+				"Content-Length: 2\r\n",
+				"Content-Range: bytes 8-9/10\r\n",
+				"\r\n\r\n89",
+			},
+		},
+		{
+			.name	= "last byte range past the end",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=5-100\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 206 Partial Content\r\n",
+				"Content-Range: bytes 5-9/10\r\n",
+				"\r\n\r\n56789",
+			},
+		},
+		{
+			.name	= "byte range past the end",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=10-20\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 416 Range Not Satisfiable\r\n",
+				"Content-Length: 0\r\n",
+				"Content-Range: bytes */10\r\n",
+			},
+		},
+		{
+			.name	= "If-None-Match hit",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"If-None-Match: \"x\", %s\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 304 Not Modified\r\n",
+				"ETag: \"",
+			},
+		},
+		{
+			.name	= "If-None-Match miss",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"If-None-Match: \"x\"\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 200 OK\r\n",
+				"\r\n\r\n0123456789",
+			},
+		},
+		{
+			.name	= "current If-Range",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=2-5\r\n"
+				"If-Range: %s\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 206 Partial Content\r\n",
+				"\r\n\r\n2345",
+			},
+		},
+		{
+			.name	= "stale If-Range",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Range: bytes=2-5\r\n"
+				"If-Range: \"0-0-0\"\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 200 OK\r\n",
+				"Content-Length: 10\r\n",
+				"\r\n\r\n0123456789",
+			},
+		},
+		{
+			.name	= "response cache hits",
+			.argv	= {target, "-c", "1", "-r", root, "-C", "1048576", "-p", "1026", NULL},
+			.req	= {
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: gzip\r\n\r\n",
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: gzip\r\n\r\n",
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: gzip, br\r\n\r\n",
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: br;q=0, gzip\r\n\r\n",
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				/* the miss, out of the file */
+				"Content-Length: 4096\r\nETag: \"",
+				GZIP_HEADER, BR_HEADER, GZIP_HEADER,
+				"Content-Length: 4096\r\n",
+				"Connection: close\r\n\r\n<p>hello, world</p>\n",
+			},
+		},
+		{
+			.name	= "no response cache",
+			.argv	= {target, "-c", "1", "-r", root, "--cache-size=0", "-p", "1026", NULL},
+			.req	= {
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: gzip\r\n\r\n",
+				"GET /text.html HTTP/1.1\r\nHost: localhost\r\n"
+				"Accept-Encoding: gzip\r\nConnection: close\r\n\r\n",
+			},
+			.want	= {
+				"Content-Length: 4096\r\nETag: \"",
+				"Content-Length: 4096\r\nETag: \"",
+			},
+		},
+		{
+			.name	= "listeners handed over on reload",
+			.argv	= {target, "-c", "2", "-r", root, "-p", "1026", "-t", "1500", NULL},
+			.req	= {
+				"GET / HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.reload	= 1,
+			.want	= {
+				"HTTP/1.1 200 OK\r\n", "hello, world\n",
+				"HTTP/1.1 200 OK\r\n", "hello, world\n",
+			},
+		},
+		{
+			.name	= "file bodies after a header",
+			.argv	= {target, "-c", "1", "-r", root, "-C", "0", "-p", "1026", NULL},
+			.req	= {
+				"HEAD /large.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+				"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+				"GET /large.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"Content-Length: 200000\r\n",
+				"Connection: keep-alive\r\n\r\nHTTP/1.1 200 OK\r\n",
+				"Connection: keep-alive\r\n\r\nhello, world\nHTTP/1.1 200 OK\r\n",
+				"Content-Length: 200000\r\n",
+				"Connection: close\r\n\r\n0123456789abcdef0123",
+			},
+		},
+		{
+			.name	= "server statistics",
+			.argv	= {target, "-c", "1", "-r", root, "-p", "1026", NULL},
+			.req	= {
+				"GET /digits.txt HTTP/1.1\r\nHost: localhost\r\n"
+				"If-None-Match: %s\r\n\r\n",
+				"GET /stats HTTP/1.1\r\nHost: localhost\r\n\r\n",
+				"GET /stats?x=1&format=json HTTP/1.1\r\nHost: localhost\r\n\r\n",
+				"GET /stats?f HTTP/1.1\r\nHost: localhost\r\n"
+				"Connection: close\r\n\r\n",
+			},
+			.want	= {
+				"HTTP/1.1 304 Not Modified\r\n",
+				"Content-Type: text/plain\r\n", "\r\n\r\nservers: 1\n",
+				"\n3xx: 1\n", "\nserver0: ", " 3xx=1 ",
+				"Content-Type: application/json\r\n", "\r\n\r\n{\"conns\":1,",
+				"\"3xx\":1,", "\"servers\":[{", "\"3xx\":1,",
+				"Content-Type: text/plain\r\n", "\r\n\r\nservers: 1\n",
+			},
+		},
+		{ .name = NULL },
+	};
+	char etag[64];
+	char *resp;
+	int ret = -1;
+
+	resp = malloc(RESP_SIZE);
+	if (resp == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	/* the new process of a reload is ours to reap */
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+		perror("prctl(PR_SET_CHILD_SUBREAPER)");
+		goto out;
+	}
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp");
+		goto out;
+	}
+	if (make_root(root) || file_etag(root, "digits.txt", etag, sizeof(etag)))
+		goto rm;
+	for (x = exchanges; x->name; x++)
+		if (run_exchange(target, x, etag, resp))
+			goto rm;
+	ret = 0;
+rm:
+	remove_root(root);
+out:
+	free(resp);
+	return ret;
+}
 
 int main(void)
 {
 	char *const target = realpath("./httpd", NULL);
 	const struct test {
 		char	*name;
-		char	*const argv[11];
+		char	*const argv[16];
 		int	want;
 	} *t, tests[] = {
 		{
@@ -119,6 +751,166 @@ int main(void)
 			.argv	= {target, "-c", "4", "-6", "-p", "65534", "-t", "1", NULL},
 			.want	= 0,
 		},
+		{
+			.name	= "document root on port 1024",
+			.argv	= {target, "-c", "1", "-r", ".", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "non-existent document root",
+			.argv	= {target, "-c", "1", "-r", "/no/such/dir", "-p", "1024", "-t", "1", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "negative response cache size",
+			.argv	= {target, "-C", "-1", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "epoll engine on port 1024",
+			.argv	= {target, "-c", "2", "--engine=epoll", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "io_uring engine on port 1024",
+			.argv	= {target, "-c", "2", "--engine=uring", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "unknown engine",
+			.argv	= {target, "-e", "kqueue", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "16 connections per server on port 1024",
+			.argv	= {target, "-c", "2", "-m", "16", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "4096 connections per server on port 1024",
+			.argv	= {target, "-c", "1", "--max-conns=4096", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "compact placement on port 1024",
+			.argv	= {target, "-c", "4", "-P", "compact", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "one server per core on port 1024",
+			.argv	= {target, "-c", "4", "--placement=core", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "servers per NUMA node on port 1024",
+			.argv	= {target, "-c", "4", "--placement=numa", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "steered connections on port 1024",
+			.argv	= {target, "-c", "4", "--steer", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "steered connections per NUMA node on port 1024",
+			.argv	= {target, "-c", "4", "-S", "-P", "numa", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "handshake and wake up tuning on port 1024",
+			.argv	= {target, "-c", "2", "-F", "256", "-D", "1", "-B", "50", "-A", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "negative fast open queue",
+			.argv	= {target, "--fastopen=-1", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "admission control on port 1024",
+			.argv	= {target, "-c", "2", "-a", "64", "-L", "10", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "paused accepts on overload on port 1024",
+			.argv	= {target, "-c", "2", "-e", "uring", "--admit-conns=64", "--overload=pause", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "unknown overload action",
+			.argv	= {target, "-O", "drop", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "unix domain socket",
+			.argv	= {target, "-c", "2", "-U", "/tmp/httpd_test.sock", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "abstract unix domain socket",
+			.argv	= {target, "-c", "2", "-e", "uring", "-U", "@httpd_test", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "unix domain socket with shared listener",
+			.argv	= {target, "-S", "-U", "/tmp/httpd_test.sock", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "listeners with a dedicated server on port 1024 and 1025",
+			.argv	= {target, "-c", "2", "-l", "127.0.0.1:1024,servers=0", "-l", "[::]:1025,backlog=16", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "steered listeners on port 1024 and 1025",
+			.argv	= {target, "-c", "2", "-S", "-e", "uring", "-l", ":1024,servers=1", "-l", ":1025", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "listener dedicated to a non-existent server",
+			.argv	= {target, "-c", "2", "-l", ":1024,servers=2", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "listener on a host name",
+			.argv	= {target, "-l", "localhost:1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "negative inherited listener socket",
+			.argv	= {target, "--inherit-fd=-1", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "no inherited listener socket",
+			.argv	= {target, "-c", "1", "-I", "100", "-p", "1024", "-t", "1", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "unknown placement",
+			.argv	= {target, "-P", "random", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "zero connections per server",
+			.argv	= {target, "-m", "0", "-p", "1024", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "connection timeouts on port 1024",
+			.argv	= {target, "-c", "2", "-H", "100", "-k", "200", "-i", "300", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "no connection timeouts on port 1024",
+			.argv	= {target, "-c", "2", "--header-timeout=0", "--keepalive-timeout=0", "-p", "1024", "-t", "1", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "negative keep-alive timeout",
+			.argv	= {target, "-k", "-1", "-p", "1024", NULL},
+			.want	= 1,
+		},
 		{ .name = NULL },
 	};
 	int ret = 0;
@@ -164,6 +956,8 @@ int main(void)
 		}
 		ret = 0;
 	}
+	if (ret == 0)
+		ret = test_exchanges(target);
 	if (target)
 		free(target);
 	if (ret)
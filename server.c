@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <limits.h>
 #include <signal.h>
@@ -9,12 +11,19 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <semaphore.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/sysinfo.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -24,44 +33,153 @@
 #ifndef ARG_MAX
 #define ARG_MAX 1024
 #endif /* ARG_MAX */
+#define RING_SIZE	16
+#define NR_EVENTS	64
+#define NR_CONNS	64	/* client connections per server */
+#define NR_COMMANDS	64	/* commands in flight per server */
+#define FRAME_MAX	65536	/* output frame payload */
+#define OBUF_SIZE	(2*(sizeof(struct frame)+FRAME_MAX))
+
+/*
+ * Every message on the connection is a frame header followed by len
+ * bytes of payload.  The client sends FRAME_EXEC with the command line
+ * and gets back FRAME_STDOUT and FRAME_STDERR chunks, then FRAME_EXIT
+ * with the exit status, all carrying the id of the FRAME_EXEC.  Keep in
+ * sync with client.c.
+ */
+enum frame_type {
+	FRAME_EXEC = 0,
+	FRAME_STDOUT,
+	FRAME_STDERR,
+	FRAME_EXIT,
+};
+
+/* in network byte order */
+struct frame {
+	uint32_t		id;
+	uint32_t		type;
+	uint32_t		len;
+};
+
+/* epoll_event data, the kind in the upper half, the index in the lower */
+enum event_kind {
+	EV_LISTENER = 0,
+	EV_EXECUTOR,
+	EV_CONN,
+	EV_STDOUT,
+	EV_STDERR,
+};
+
+/* command queued by the server for one of its executors */
+struct job {
+	unsigned		cmd;
+	char			cmdline[LINE_MAX];
+};
+
+/* single producer, multiple consumer job ring shared with the executors */
+struct ring {
+	sem_t			free;		/* empty slots */
+	sem_t			ready;		/* queued jobs */
+	sem_t			lock;		/* serializes the executors */
+	unsigned		head;
+	unsigned		tail;
+	struct job		jobs[RING_SIZE];
+};
+
+/*
+ * Executor to server message.  The output pipes come along with the
+ * first one, and the second one has the wait(2) status.
+ */
+struct report {
+	unsigned		cmd;
+	int			status;		/* -1 while running */
+};
+
+/* client connection */
+struct conn {
+	int			sd;
+	int			readable;
+	int			stalled;	/* no room for the next command */
+	int			eof;
+	unsigned		nr_cmds;
+	unsigned		ilen;
+	unsigned		olen;
+	struct command		*scmd;		/* frame being spliced */
+	int			sidx;
+	size_t			srem;
+	char			ibuf[sizeof(struct frame)+LINE_MAX];
+	char			obuf[OBUF_SIZE];
+};
+
+/* command in flight */
+struct command {
+	struct conn		*c;		/* NULL once the client is gone */
+	uint32_t		id;
+	int			busy;
+	int			status;		/* -1 while running */
+	int			fds[2];		/* stdout and stderr pipes */
+	int			readable[2];
+};
 
 struct server {
 	pid_t			pid;
 	int			sd;
+	int			xsd;		/* executor reports */
+	int			efd;
+	int			retry;		/* stalled connections to resume */
+	struct ring		*ring;
+	struct conn		*conns;
+	struct command		cmds[NR_COMMANDS];
 	const struct process	*p;
 };
 
 static struct process {
 	int			daemon:1;
+	int			spawn:1;
 	unsigned		timeout;
+	unsigned long		*last;		/* shared activity timestamp */
+	int			tfd;
 	unsigned short		backlog;
 	unsigned short		concurrent;
+	unsigned short		executors;
 	int			family;
 	int			type;
 	int			proto;
 	int			port;
+	const char		*path;		/* Unix domain socket */
+	int			usd;		/* shared Unix domain listener */
 	FILE			*output;
 	struct server		*ss;
+	pid_t			parent;		/* of the servers */
 	const char		*progname;
 	const char		*const opts;
 	const struct option	lopts[];
 } process = {
 	.daemon		= 0,
+	.spawn		= 0,
 	.timeout	= 30000,
+	.last		= NULL,
+	.tfd		= -1,
 	.backlog	= 5,
 	.concurrent	= 2,
+	.executors	= 2,
 	.family		= AF_INET,
 	.type		= SOCK_STREAM,
 	.proto		= 0,
 	.port		= 9999,
+	.path		= NULL,
+	.usd		= -1,
 	.ss		= NULL,
 	.progname	= NULL,
-	.opts		= "t:b:c:dsh",
+	.opts		= "t:b:c:e:dsU:h",
 	.lopts		= {
 		{"timeout",	required_argument,	NULL,	't'},
 		{"backlog",	required_argument,	NULL,	'b'},
 		{"concurrent",	required_argument,	NULL,	'c'},
+		{"executors",	required_argument,	NULL,	'e'},
 		{"daemon",	no_argument,		NULL,	'd'},
+		{"spawn",	no_argument,		NULL,	's'},
+		{"unix",	required_argument,	NULL,	'U'},
 		{"help",	no_argument,		NULL,	'h'},
 		{NULL, 0, NULL, 0},
 	},
@@ -88,9 +206,19 @@ static void usage(const struct process *restrict p, FILE *stream, int status)
 			fprintf(stream, "\tconcurrent servers (default: %hu)\n",
 				p->concurrent);
 			break;
+		case 'e':
+			fprintf(stream, "\tcommand executors per server (default: %hu)\n",
+				p->executors);
+			break;
 		case 'd':
 			fprintf(stream, "\t\tdaemonize the server\n");
 			break;
+		case 's':
+			fprintf(stream, "\t\tspawn the commands with posix_spawn(3) instead of fork(2)\n");
+			break;
+		case 'U':
+			fprintf(stream, "\t\tlisten on the Unix domain socket path, @name for abstract\n");
+			break;
 		case 'h':
 			fprintf(stream, "\t\tdisplay this message and exit\n");
 			break;
@@ -108,7 +236,7 @@ static int init_server_socket(struct server *ctx)
 	struct sockaddr_in sin;
 	int sd, ret, opt;
 
-	sd = socket(p->family, p->type, p->proto);
+	sd = socket(p->family, p->type|SOCK_NONBLOCK|SOCK_CLOEXEC, p->proto);
 	if (sd == -1) {
 		perror("socket");
 		ret = -1;
@@ -142,21 +270,64 @@ err:
 	return ret;
 }
 
-static int reset_timer(const struct process *restrict p)
+/* shared by all the servers, as SO_REUSEPORT is TCP and UDP only */
+static int init_unix_socket(struct process *p)
 {
-	const union sigval val = {.sival_int = getpid()};
-	int ret;
-
-	/* no timer */
-	if (p->timeout == -1)
-		return 0;
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	socklen_t slen;
+	struct stat st;
+	int sd, ret;
 
-	ret = sigqueue(getppid(), SIGUSR1, val);
-	if (ret == -1) {
-		perror("sigqueue");
+	strcpy(sun.sun_path, p->path);
+	slen = offsetof(struct sockaddr_un, sun_path) + strlen(p->path) + 1;
+	if (p->path[0] == '@') {
+		/* abstract namespace */
+		sun.sun_path[0] = '\0';
+		slen--;
+	} else if (stat(p->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		/* left over by the previous run */
+		if (unlink(p->path) == -1) {
+			perror("unlink");
+			return -1;
+		}
+	}
+	sd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
 		return -1;
 	}
+	ret = bind(sd, (struct sockaddr *)&sun, slen);
+	if (ret == -1) {
+		perror("bind");
+		goto err;
+	}
+	ret = listen(sd, p->backlog);
+	if (ret == -1) {
+		perror("listen");
+		goto err;
+	}
+	p->usd = sd;
 	return 0;
+err:
+	if (close(sd))
+		perror("close");
+	return -1;
+}
+
+static unsigned long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000UL + ts.tv_nsec/1000000;
+}
+
+/* no syscall, the parent checks it when the timer fires */
+static void reset_timer(const struct process *restrict p)
+{
+	if (p->last == NULL)
+		return;
+	__atomic_store_n(p->last, now_msec(), __ATOMIC_RELAXED);
 }
 
 static void dump(FILE *s, const unsigned char *restrict buf, size_t len)
@@ -179,153 +350,887 @@ static void dump(FILE *s, const unsigned char *restrict buf, size_t len)
 	}
 }
 
-static int handle(struct server *ctx, char *const cmdline,
-		  struct sockaddr *sa, socklen_t slen)
+/* fork and redirect the stdout and stderr in the child */
+static pid_t fork_command(const int fds[2], char *const argv[])
 {
-	const struct process *const p = ctx->p;
-	const char *msg = "internal server error\n\0";
-	int ret, status, fd = -1;
-	char buf[LINE_MAX];
 	pid_t pid;
+	int ret;
 
-	/* send response back over the UDP socket */
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (fd == -1) {
-		perror("socket");
-		return -1;
-	}
-	ret = connect(fd, sa, slen);
-	if (ret == -1) {
-		perror("connect");
-		if (close(fd))
-			perror("close");
-		goto out;
-	}
-	ret = -1;
 	pid = fork();
 	if (pid == -1) {
 		perror("fork");
-		goto out;
+		return -1;
 	} else if (pid == 0) {
-		char *argv[ARG_MAX], *start = cmdline;
-		int i, ret;
-
-		ret = dup2(fd, STDOUT_FILENO);
+		/*
+		 * 127 as the shell and posix_spawn(3) have it, and no
+		 * atexit(3) handlers or stdio buffers of the server.
+		 */
+		ret = dup2(fds[0], STDOUT_FILENO);
 		if (ret == -1) {
 			perror("dup2");
-			exit(EXIT_FAILURE);
+			_exit(127);
 		}
-		for (i = 0; i < ARG_MAX; i++) {
-			argv[i] = strtok(start, " \t\n\r");
-			if (argv[i] == NULL)
-				break;
-			start = NULL;
+		ret = dup2(fds[1], STDERR_FILENO);
+		if (ret == -1) {
+			perror("dup2");
+			_exit(127);
 		}
 		ret = execvp(argv[0], argv);
 		if (ret == -1) {
 			perror("execvp");
-			exit(EXIT_FAILURE);
+			_exit(127);
 		}
 		/* not reachable */
 	}
-	ret = waitpid(pid, &status, 0);
-	if (ret == -1) {
-		msg = strerror(errno);
-		goto err;
+	return pid;
+}
+
+/*
+ * posix_spawn(3) shares the address space with the child until the
+ * exec, so nothing is copied however large the caller is.
+ */
+static pid_t spawn_command(const int fds[2], char *const argv[])
+{
+	posix_spawn_file_actions_t fa;
+	pid_t pid = -1;
+	int ret;
+
+	ret = posix_spawn_file_actions_init(&fa);
+	if (ret) {
+		fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(ret));
+		return -1;
 	}
-	ret = -1;
-	if (WIFSIGNALED(status)) {
-		ret = snprintf(buf, sizeof(buf), "child terminated by signale(%s)\n",
-			       strsignal(WTERMSIG(status)));
-		if (ret < 0)
-			goto err;
-		msg = buf;
-		goto err;
+	ret = posix_spawn_file_actions_adddup2(&fa, fds[0], STDOUT_FILENO);
+	if (ret == 0)
+		ret = posix_spawn_file_actions_adddup2(&fa, fds[1], STDERR_FILENO);
+	if (ret) {
+		fprintf(stderr, "posix_spawn_file_actions_adddup2: %s\n", strerror(ret));
+		goto out;
 	}
-	if (!WIFEXITED(status)) {
-		ret = snprintf(buf, sizeof(buf), "child did not exit successfully\n");
-		if (ret < 0)
-			goto err;
-		msg = buf;
-		goto err;
+	ret = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	if (ret)
+		pid = -1;
+out:
+	if (posix_spawn_file_actions_destroy(&fa))
+		fprintf(stderr, "posix_spawn_file_actions_destroy: failed\n");
+	/* for the caller's strerror() */
+	if (ret)
+		errno = ret;
+	return pid;
+}
+
+static int send_report(int sd, unsigned cmd, int status, const int fds[2])
+{
+	struct report r = {.cmd = cmd, .status = status};
+	struct iovec iov = {.iov_base = &r, .iov_len = sizeof(r)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+	union {
+		char		buf[CMSG_SPACE(2*sizeof(int))];
+		struct cmsghdr	align;
+	} u;
+	struct cmsghdr *cm;
+
+	if (fds) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(2*sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, 2*sizeof(int));
 	}
-	if (WEXITSTATUS(status) != 0) {
-		ret = snprintf(buf, sizeof(buf), "child exit with exit status(%d)\n",
-			       WEXITSTATUS(status));
-		if (ret < 0)
-			goto err;
-		msg = buf;
-		goto err;
+	while (sendmsg(sd, &msg, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		perror("sendmsg");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Run the job with its stdout and stderr on pipes, which are handed
+ * over to the server right away so that the output flows while the
+ * executor waits for the exit status.
+ */
+static int handle(struct server *ctx, struct job *job)
+{
+	const struct process *const p = ctx->p;
+	int i, ret, status = W_EXITCODE(127, 0);
+	int out[2] = {-1, -1}, err[2] = {-1, -1};
+	char *argv[ARG_MAX], *start = job->cmdline;
+	pid_t pid = -1;
+
+	for (i = 0; i < ARG_MAX-1; i++) {
+		argv[i] = strtok(start, " \t\n\r");
+		if (argv[i] == NULL)
+			break;
+		start = NULL;
+	}
+	argv[i] = NULL;
+	if (argv[0] == NULL)
+		goto out;
+	if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		goto out;
+	}
+	{
+		const int fds[2] = {out[1], err[1]};
+		if (p->spawn)
+			pid = spawn_command(fds, argv);
+		else
+			pid = fork_command(fds, argv);
+	}
+	if (pid == -1)
+		dprintf(err[1], "%s: %s\n", argv[0], strerror(errno));
+	for (i = 0; i < 2; i++) {
+		int *fd = i ? &err[1] : &out[1];
+		if (close(*fd))
+			perror("close");
+		*fd = -1;
+	}
+	{
+		const int fds[2] = {out[0], err[0]};
+		ret = send_report(ctx->xsd, job->cmd, -1, fds);
+		if (ret == -1)
+			goto out;
+	}
+	if (pid != -1) {
+		while ((ret = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+			continue;
+		if (ret == -1) {
+			perror("waitpid");
+			status = W_EXITCODE(EXIT_FAILURE, 0);
+		}
 	}
-	ret = 0;
-	goto out;
-err:
-	fprintf(p->output, "%s", msg);
-	ret = send(fd, msg, strlen(msg)+1, 0);
-	if (ret == -1)
-		perror("send");
 out:
-	if (fd != -1)
-		if (close(fd))
+	for (i = 0; i < 2; i++) {
+		if (out[i] != -1 && close(out[i]))
 			perror("close");
+		if (err[i] != -1 && close(err[i]))
+			perror("close");
+	}
+	return send_report(ctx->xsd, job->cmd, status, NULL);
+}
+
+static int sem_wait_intr(sem_t *sem)
+{
+	int ret;
+
+	while ((ret = sem_wait(sem)) == -1 && errno == EINTR)
+		continue;
+	if (ret == -1)
+		perror("sem_wait");
 	return ret;
 }
 
-static void *server(void *arg)
+static struct ring *init_ring(void)
+{
+	struct ring *r;
+
+	r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	if (sem_init(&r->free, 1, RING_SIZE) == -1
+	    || sem_init(&r->ready, 1, 0) == -1
+	    || sem_init(&r->lock, 1, 1) == -1) {
+		perror("sem_init");
+		if (munmap(r, sizeof(*r)))
+			perror("munmap");
+		return NULL;
+	}
+	r->head = r->tail = 0;
+	return r;
+}
+
+/* queue the command, or return 1 when all the slots are in use */
+static int enqueue(struct ring *r, unsigned cmd, const char *cmdline,
+		   size_t len)
+{
+	struct job *job;
+
+	if (sem_trywait(&r->free) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		perror("sem_trywait");
+		return -1;
+	}
+	job = &r->jobs[r->head++%RING_SIZE];
+	if (len >= sizeof(job->cmdline))
+		len = sizeof(job->cmdline)-1;
+	memcpy(job->cmdline, cmdline, len);
+	job->cmdline[len] = '\0';
+	job->cmd = cmd;
+	if (sem_post(&r->ready) == -1) {
+		perror("sem_post");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Jobs are copied out in order so that the freed slot is always the
+ * oldest one, which is the next one the server writes.
+ */
+static int dequeue(struct ring *r, struct job *job)
+{
+	int ret = -1;
+
+	if (sem_wait_intr(&r->ready) == -1)
+		return -1;
+	if (sem_wait_intr(&r->lock) == -1)
+		return -1;
+	*job = r->jobs[r->tail++%RING_SIZE];
+	if (sem_post(&r->lock) == -1) {
+		perror("sem_post");
+		goto out;
+	}
+	ret = 0;
+out:
+	if (sem_post(&r->free) == -1) {
+		perror("sem_post");
+		ret = -1;
+	}
+	return ret;
+}
+
+/* long lived executor, sharing the server's job ring and report socket */
+static int executor(struct server *ctx, pid_t ppid)
 {
-	struct server *ctx = arg;
 	const struct process *const p = ctx->p;
-	socklen_t slen = sizeof(struct sockaddr_in);
-	struct sockaddr_in sin;
-	char *client, addr[INET_ADDRSTRLEN];
-	char buf[BUFSIZ];
-	ssize_t len;
+	struct job job;
 	int ret;
 
-	ret = init_server_socket(ctx);
-	if (ret == -1)
-		return (void *)EXIT_FAILURE;
+	/* go away together with the server */
+	ret = prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (ret == -1) {
+		perror("prctl(PR_SET_PDEATHSIG)");
+		return -1;
+	}
+	if (getppid() != ppid)
+		return 0;
+	if (p->usd != -1)
+		if (close(p->usd))
+			perror("close");
 	for (;;) {
-		fprintf(p->output, "accepting...\n");
-		int c = accept(ctx->sd, &sin, &slen);
-		if (c == -1) {
-			perror("accept");
+		ret = dequeue(ctx->ring, &job);
+		if (ret == -1)
+			break;
+		ret = handle(ctx, &job);
+		if (ret == -1)
+			break;
+	}
+	return -1;
+}
+
+static int init_executors(struct server *ctx)
+{
+	const struct process *const p = ctx->p;
+	pid_t pid, ppid = getpid();
+	int i, sv[2];
+
+	ctx->ring = init_ring();
+	if (ctx->ring == NULL)
+		return -1;
+	/* message boundaries keep the reports of the executors apart */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	for (i = 0; i < p->executors; i++) {
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			return -1;
+		} else if (pid == 0) {
+			if (close(sv[0]))
+				perror("close");
+			ctx->xsd = sv[1];
+			if (executor(ctx, ppid))
+				exit(EXIT_FAILURE);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	if (close(sv[1]))
+		perror("close");
+	ctx->xsd = sv[0];
+	return 0;
+}
+
+static int watch(struct server *ctx, int fd, uint32_t events,
+		 enum event_kind kind, unsigned idx)
+{
+	struct epoll_event ev = {
+		.events		= events,
+		.data.u64	= (uint64_t)kind << 32 | idx,
+	};
+
+	if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+static void put_header(struct conn *c, uint32_t id, enum frame_type type,
+		       size_t len)
+{
+	struct frame f = {
+		.id	= htonl(id),
+		.type	= htonl(type),
+		.len	= htonl(len),
+	};
+
+	memcpy(c->obuf+c->olen, &f, sizeof(f));
+	c->olen += sizeof(f);
+}
+
+/* payload is already in place right after the header */
+static void put_frame(struct conn *c, uint32_t id, enum frame_type type,
+		      size_t len)
+{
+	put_header(c, id, type, len);
+	c->olen += len;
+}
+
+static int flush_conn(struct conn *c)
+{
+	ssize_t len;
+
+	while (c->olen) {
+		len = send(c->sd, c->obuf, c->olen, MSG_NOSIGNAL);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			perror("send");
+			return -1;
+		}
+		c->olen -= len;
+		memmove(c->obuf, c->obuf+len, c->olen);
+	}
+	return 0;
+}
+
+static void close_stream(struct command *cmd, int i)
+{
+	/* closing takes it out of the epoll set, too */
+	if (close(cmd->fds[i]))
+		perror("close");
+	cmd->fds[i] = -1;
+	cmd->readable[i] = 0;
+}
+
+/*
+ * Move the rest of the frame payload from the pipe to the connection
+ * with splice(2).  Returns 1 while the socket is full, and nothing
+ * else can go out on the connection until the frame is complete.
+ */
+static int splice_out(struct conn *c)
+{
+	const struct command *cmd = c->scmd;
+	ssize_t len;
+
+	while (c->srem) {
+		len = splice(cmd->fds[c->sidx], NULL, c->sd, NULL, c->srem,
+			     SPLICE_F_NONBLOCK);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+			perror("splice");
+			return -1;
+		} else if (len == 0) {
+			/* the payload length was already sent */
+			fprintf(stderr, "short splice\n");
+			return -1;
+		}
+		c->srem -= len;
+	}
+	c->scmd = NULL;
+	return 0;
+}
+
+/*
+ * Frame what is in the pipe and splice it straight to the idle
+ * connection, returning 1 when it is in progress.  Only the header goes
+ * through the connection buffer.  If the header doesn't go out in one
+ * go, the payload is copied after it instead.
+ */
+static int splice_stream(struct command *cmd, int i)
+{
+	struct conn *c = cmd->c;
+	ssize_t len;
+	size_t rem;
+	int avail;
+
+	if (c->olen || ioctl(cmd->fds[i], FIONREAD, &avail) == -1 || avail <= 0)
+		return 0;
+	rem = avail > FRAME_MAX ? FRAME_MAX : avail;
+	put_header(c, cmd->id, i ? FRAME_STDERR : FRAME_STDOUT, rem);
+	len = send(c->sd, c->obuf, c->olen, MSG_NOSIGNAL|MSG_MORE);
+	if (len == c->olen) {
+		c->olen = 0;
+		c->scmd = cmd;
+		c->sidx = i;
+		c->srem = rem;
+		return 1;
+	}
+	if (len > 0) {
+		c->olen -= len;
+		memmove(c->obuf, c->obuf+len, c->olen);
+	}
+	/* no one else reads the pipe, so all of it is there */
+	while (rem) {
+		len = read(cmd->fds[i], c->obuf+c->olen, rem);
+		if (len == -1 && errno == EINTR)
 			continue;
+		if (len <= 0)
+			break;
+		c->olen += len;
+		rem -= len;
+	}
+	return 0;
+}
+
+/*
+ * Move the command output to the connection.  A full buffer leaves the
+ * pipe alone, which blocks the command once the pipe fills up, until
+ * the client catches up.
+ */
+static void pump(struct command *cmd, int i)
+{
+	struct conn *c = cmd->c;
+	ssize_t len;
+	size_t room;
+
+	while (cmd->fds[i] != -1 && cmd->readable[i] && c->scmd == NULL) {
+		if (splice_stream(cmd, i))
+			break;
+		room = OBUF_SIZE - c->olen;
+		if (room <= sizeof(struct frame))
+			break;
+		room -= sizeof(struct frame);
+		if (room > FRAME_MAX)
+			room = FRAME_MAX;
+		len = read(cmd->fds[i], c->obuf+c->olen+sizeof(struct frame), room);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				cmd->readable[i] = 0;
+				break;
+			}
+			perror("read");
+			len = 0;
+		}
+		if (len == 0) {
+			close_stream(cmd, i);
+			break;
 		}
-		client = (char *)inet_ntop(p->family, &sin.sin_addr, addr, sizeof(addr));
-		if (client == NULL)
-			ret = snprintf(buf, sizeof(buf), "Client connected\n");
+		put_frame(c, cmd->id, i ? FRAME_STDERR : FRAME_STDOUT, len);
+	}
+}
+
+/* exit status trailer, once the command is gone and its output is out */
+static void finish(struct server *ctx, struct command *cmd)
+{
+	struct conn *c = cmd->c;
+	uint32_t code;
+
+	if (!cmd->busy || cmd->status == -1)
+		return;
+	if (cmd->fds[0] != -1 || cmd->fds[1] != -1)
+		return;
+	if (c) {
+		if (OBUF_SIZE - c->olen < sizeof(struct frame)+sizeof(code))
+			return;
+		if (WIFSIGNALED(cmd->status))
+			code = 128+WTERMSIG(cmd->status);
 		else
-			ret = snprintf(buf, sizeof(buf), "%s:%d connected\n",
-				       client, ntohs(sin.sin_port));
-		if (ret < 0) {
-			perror("snprintf");
-			if (shutdown(c, SHUT_RDWR))
-				perror("shutdown");
+			code = WEXITSTATUS(cmd->status);
+		code = htonl(code);
+		memcpy(c->obuf+c->olen+sizeof(struct frame), &code, sizeof(code));
+		put_frame(c, cmd->id, FRAME_EXIT, sizeof(code));
+		c->nr_cmds--;
+	}
+	cmd->busy = 0;
+	ctx->retry = 1;
+}
+
+static void close_conn(struct server *ctx, struct conn *c)
+{
+	struct command *cmd;
+	int i, j;
+
+	for (i = 0; i < NR_COMMANDS; i++) {
+		cmd = &ctx->cmds[i];
+		if (!cmd->busy || cmd->c != c)
+			continue;
+		/* the command gets EPIPE or SIGPIPE on the next write */
+		for (j = 0; j < 2; j++)
+			if (cmd->fds[j] != -1)
+				close_stream(cmd, j);
+		cmd->c = NULL;
+		finish(ctx, cmd);
+	}
+	if (close(c->sd))
+		perror("close");
+	c->sd = -1;
+	c->scmd = NULL;
+}
+
+static void service_conn(struct server *ctx, struct conn *c)
+{
+	struct command *cmd;
+	int i, j, ret, produced;
+	unsigned olen;
+
+	for (;;) {
+		ret = c->scmd ? splice_out(c) : 0;
+		if (ret == -1) {
+			close_conn(ctx, c);
+			return;
+		} else if (ret == 1)
+			/* wait for EPOLLOUT */
+			return;
+		olen = c->olen;
+		for (i = 0; i < NR_COMMANDS; i++) {
+			cmd = &ctx->cmds[i];
+			if (!cmd->busy || cmd->c != c)
+				continue;
+			for (j = 0; j < 2; j++)
+				pump(cmd, j);
+			finish(ctx, cmd);
+		}
+		produced = c->olen != olen;
+		/* the buffer goes out after the frame being spliced */
+		if (c->scmd)
 			continue;
+		if (flush_conn(c) == -1) {
+			close_conn(ctx, c);
+			return;
 		}
-		reset_timer(p);
-		len = recv(c, buf, sizeof(buf), 0);
+		/* wait for EPOLLOUT, or for more output */
+		if (c->olen || !produced)
+			break;
+	}
+	if (c->eof && c->nr_cmds == 0 && c->olen == 0)
+		close_conn(ctx, c);
+}
+
+/* returns 1 when the command needs to wait for a free slot */
+static int exec_command(struct server *ctx, struct conn *c, uint32_t id,
+			const char *cmdline, size_t len)
+{
+	struct command *cmd;
+	int i, ret;
+
+	for (i = 0; i < NR_COMMANDS; i++)
+		if (!ctx->cmds[i].busy)
+			break;
+	if (i == NR_COMMANDS)
+		return 1;
+	ret = enqueue(ctx->ring, i, cmdline, len);
+	if (ret)
+		return ret;
+	cmd = &ctx->cmds[i];
+	cmd->c = c;
+	cmd->id = id;
+	cmd->busy = 1;
+	cmd->status = -1;
+	cmd->fds[0] = cmd->fds[1] = -1;
+	cmd->readable[0] = cmd->readable[1] = 0;
+	c->nr_cmds++;
+	reset_timer(ctx->p);
+	dump(ctx->p->output, (const unsigned char *)cmdline, len);
+	return 0;
+}
+
+static int parse_conn(struct server *ctx, struct conn *c)
+{
+	struct frame f;
+	size_t len;
+	int ret;
+
+	while (c->ilen >= sizeof(f)) {
+		memcpy(&f, c->ibuf, sizeof(f));
+		len = ntohl(f.len);
+		if (ntohl(f.type) != FRAME_EXEC || len >= LINE_MAX) {
+			fprintf(stderr, "invalid frame(type=%u,len=%zu)\n",
+				ntohl(f.type), len);
+			return -1;
+		}
+		if (c->ilen < sizeof(f)+len)
+			break;
+		ret = exec_command(ctx, c, ntohl(f.id), c->ibuf+sizeof(f), len);
+		if (ret == -1)
+			return -1;
+		else if (ret == 1) {
+			c->stalled = 1;
+			break;
+		}
+		c->ilen -= sizeof(f)+len;
+		memmove(c->ibuf, c->ibuf+sizeof(f)+len, c->ilen);
+	}
+	return 0;
+}
+
+static void read_conn(struct server *ctx, struct conn *c)
+{
+	ssize_t len;
+
+	c->stalled = 0;
+	for (;;) {
+		if (parse_conn(ctx, c) == -1) {
+			close_conn(ctx, c);
+			return;
+		}
+		if (c->stalled || c->eof || !c->readable)
+			break;
+		len = recv(c->sd, c->ibuf+c->ilen, sizeof(c->ibuf)-c->ilen, 0);
 		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				c->readable = 0;
+				break;
+			}
 			perror("recv");
-			if (shutdown(c, SHUT_RDWR))
-				perror("shutdown");
-			continue;
-		} else if (len == 0) {
-			if (shutdown(c, SHUT_RDWR))
-				perror("shutdown");
-			continue;
+			close_conn(ctx, c);
+			return;
+		} else if (len == 0)
+			c->eof = 1;
+		c->ilen += len;
+	}
+	service_conn(ctx, c);
+}
+
+static void accept_conns(struct server *ctx)
+{
+	const struct process *const p = ctx->p;
+	char *client, addr[INET_ADDRSTRLEN];
+	socklen_t slen;
+	struct sockaddr_in sin;
+	struct conn *c;
+	int i, sd;
+
+	for (;;) {
+		slen = sizeof(sin);
+		sd = accept4(ctx->sd, (struct sockaddr *)&sin, &slen,
+			     SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (sd == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				perror("accept4");
+			break;
 		}
 		reset_timer(p);
-		dump(p->output, (unsigned char *)buf, len);
-		ret = shutdown(c, SHUT_RDWR);
-		if (ret == -1) {
-			perror("shutdown");
+		if (p->path)
+			fprintf(p->output, "Client connected\n");
+		else {
+			client = (char *)inet_ntop(p->family, &sin.sin_addr,
+						   addr, sizeof(addr));
+			fprintf(p->output, "%s:%d connected\n",
+				client ? client : "?", ntohs(sin.sin_port));
+		}
+		for (i = 0; i < NR_CONNS; i++)
+			if (ctx->conns[i].sd == -1)
+				break;
+		if (i == NR_CONNS) {
+			fprintf(stderr, "too many connections\n");
+			if (close(sd))
+				perror("close");
+			continue;
+		}
+		c = &ctx->conns[i];
+		c->sd = sd;
+		c->readable = c->stalled = c->eof = 0;
+		c->nr_cmds = c->ilen = c->olen = 0;
+		c->scmd = NULL;
+		if (watch(ctx, sd, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+			  EV_CONN, i) == -1) {
+			close_conn(ctx, c);
 			continue;
 		}
-		/* Use the same port for the response */
-		sin.sin_port = htons(p->port);
-		handle(ctx, buf, (struct sockaddr *)&sin, slen);
+	}
+}
+
+/* returns -1 once there is no executor left */
+static int read_reports(struct server *ctx)
+{
+	union {
+		char		buf[CMSG_SPACE(2*sizeof(int))];
+		struct cmsghdr	align;
+	} u;
+	struct report r;
+	struct iovec iov = {.iov_base = &r, .iov_len = sizeof(r)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+	struct command *cmd;
+	struct cmsghdr *cm;
+	int i, nr, fds[2];
+	ssize_t len;
+
+	for (;;) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		len = recvmsg(ctx->xsd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				perror("recvmsg");
+			break;
+		} else if (len == 0) {
+			/*
+			 * Nothing can run any more, and the socket would
+			 * stay readable for good.
+			 */
+			fprintf(stderr, "executors exited\n");
+			return -1;
+		}
+		/* as many descriptors as made it, even truncated */
+		nr = 0;
+		cm = CMSG_FIRSTHDR(&msg);
+		if (cm && cm->cmsg_level == SOL_SOCKET
+		    && cm->cmsg_type == SCM_RIGHTS) {
+			nr = (cm->cmsg_len-CMSG_LEN(0))/sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), nr*sizeof(int));
+		}
+		if (len != sizeof(r) || r.cmd >= NR_COMMANDS
+		    || msg.msg_flags&MSG_CTRUNC || (nr && nr != 2)) {
+			if (msg.msg_flags&MSG_CTRUNC)
+				fprintf(stderr, "executor report: truncated control message\n");
+			else
+				fprintf(stderr, "executor report: unexpected %zd bytes and %d descriptors\n",
+					len, nr);
+			for (i = 0; i < nr; i++)
+				if (close(fds[i]))
+					perror("close");
+			/* the command still gets its exit status */
+			if (len != sizeof(r) || r.cmd >= NR_COMMANDS)
+				continue;
+			nr = 0;
+		}
+		/* a ring slot or a command slot is free now */
+		ctx->retry = 1;
+		cmd = &ctx->cmds[r.cmd];
+		if (nr) {
+			for (i = 0; i < 2; i++) {
+				cmd->fds[i] = fds[i];
+				if (cmd->c == NULL
+				    || fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1
+				    || watch(ctx, fds[i], EPOLLIN|EPOLLET,
+					     i ? EV_STDERR : EV_STDOUT, r.cmd) == -1)
+					close_stream(cmd, i);
+				else
+					cmd->readable[i] = 1;
+			}
+		}
+		if (r.status != -1)
+			cmd->status = r.status;
+		if (cmd->c)
+			service_conn(ctx, cmd->c);
+		else
+			finish(ctx, cmd);
+	}
+	return 0;
+}
+
+static void *server(void *arg)
+{
+	struct server *ctx = arg;
+	const struct process *const p = ctx->p;
+	struct epoll_event events[NR_EVENTS];
+	struct command *cmd;
+	struct conn *c;
+	unsigned idx;
+	int i, nr, ret;
+
+	ctx->conns = calloc(NR_CONNS, sizeof(struct conn));
+	if (ctx->conns == NULL) {
+		perror("calloc");
+		return (void *)EXIT_FAILURE;
+	}
+	for (i = 0; i < NR_CONNS; i++)
+		ctx->conns[i].sd = -1;
+	/* executors first, so that they don't inherit the listener */
+	ret = init_executors(ctx);
+	if (ret == -1)
+		return (void *)EXIT_FAILURE;
+	if (p->path)
+		ctx->sd = p->usd;
+	else {
+		ret = init_server_socket(ctx);
+		if (ret == -1)
+			return (void *)EXIT_FAILURE;
+	}
+	ctx->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->efd == -1) {
+		perror("epoll_create1");
+		return (void *)EXIT_FAILURE;
+	}
+	/* the Unix domain listener is shared by all the servers */
+	ret = watch(ctx, ctx->sd, EPOLLIN|(p->path ? EPOLLEXCLUSIVE : 0),
+		    EV_LISTENER, 0);
+	if (ret == -1)
+		return (void *)EXIT_FAILURE;
+	ret = watch(ctx, ctx->xsd, EPOLLIN, EV_EXECUTOR, 0);
+	if (ret == -1)
+		return (void *)EXIT_FAILURE;
+	for (;;) {
+		nr = epoll_wait(ctx->efd, events, NR_EVENTS, -1);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return (void *)EXIT_FAILURE;
+		}
+		for (i = 0; i < nr; i++) {
+			idx = (uint32_t)events[i].data.u64;
+			switch (events[i].data.u64 >> 32) {
+			case EV_LISTENER:
+				accept_conns(ctx);
+				break;
+			case EV_EXECUTOR:
+				/* the connections go with the process */
+				if (read_reports(ctx) == -1)
+					return (void *)EXIT_FAILURE;
+				break;
+			case EV_CONN:
+				c = &ctx->conns[idx];
+				if (c->sd == -1)
+					break;
+				if (events[i].events & ~EPOLLOUT)
+					c->readable = 1;
+				read_conn(ctx, c);
+				break;
+			case EV_STDOUT:
+			case EV_STDERR:
+				cmd = &ctx->cmds[idx];
+				ret = events[i].data.u64 >> 32 == EV_STDERR;
+				if (!cmd->busy || cmd->fds[ret] == -1)
+					break;
+				cmd->readable[ret] = 1;
+				service_conn(ctx, cmd->c);
+				break;
+			}
+		}
+		/* resume the connections waiting for a free slot */
+		while (ctx->retry) {
+			ctx->retry = 0;
+			for (i = 0; i < NR_CONNS; i++) {
+				c = &ctx->conns[i];
+				if (c->sd != -1 && c->stalled)
+					read_conn(ctx, c);
+			}
+		}
 	}
 	return NULL;
 }
@@ -335,12 +1240,15 @@ static int init_server(struct process *p)
 	struct server *ss, *s;
 	int i, j, ret, *retp;
 
+	if (p->path && init_unix_socket(p) == -1)
+		return -1;
 	ss = calloc(p->concurrent, sizeof(struct server));
 	if (ss == NULL) {
 		perror("calloc");
 		return -1;
 	}
 	s = p->ss = ss;
+	p->parent = getpid();
 	for (i = 0; i < p->concurrent; i++) {
 		s->p = p;
 		s->pid = fork();
@@ -374,105 +1282,98 @@ err:
 	return -1;
 }
 
-static void timeout_action(int signo, siginfo_t *si, void *tcontext)
+/* no timer with -1, or 0 as setitimer(2) used to disarm it */
+static int has_timer(const struct process *restrict p)
 {
-	const struct process *const p = &process;
-	struct server *s;
-	int i;
+	return p->timeout != -1 && p->timeout != 0;
+}
 
-	if (signo != SIGALRM)
-		return;
-	printf("terminating servers\n");
-	s = p->ss;
-	for (i = 0, s = p->ss; i < p->concurrent; i++, s++) {
-		int ret, status;
-		if (s->pid == -1)
-			continue;
-		ret = kill(s->pid, SIGTERM);
-		if (ret == -1) {
-			perror("kill");
-			continue;
-		}
-		ret = waitpid(s->pid, &status, WNOHANG);
-		if (ret == -1)
-			perror("waitpid");
+/* the activity timestamp is shared with the servers */
+static int init_activity(struct process *p)
+{
+	if (!has_timer(p))
+		return 0;
+	p->last = mmap(NULL, sizeof(*p->last), PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p->last == MAP_FAILED) {
+		perror("mmap");
+		p->last = NULL;
+		return -1;
 	}
-	exit(EXIT_SUCCESS);
+	reset_timer(p);
+	return 0;
 }
 
-static int init_timer(const struct process *restrict p)
+static int arm_timer(const struct process *restrict p, unsigned long msec)
 {
-	const struct itimerval it = {
+	const struct itimerspec it = {
 		.it_value = {
-			.tv_sec		= p->timeout/1000,
-			.tv_usec	= p->timeout%1000*1000,
+			.tv_sec		= msec/1000,
+			.tv_nsec	= msec%1000*1000000,
 		},
 		.it_interval = {0, 0},
 	};
 	int ret;
 
-	/* no timer */
-	if (p->timeout == -1)
-		return 0;
-
-	/* arm the new timer */
-	ret = setitimer(ITIMER_REAL, &it, NULL);
+	ret = timerfd_settime(p->tfd, TFD_TIMER_ABSTIME, &it, NULL);
 	if (ret == -1) {
-		perror("setitimer");
+		perror("timerfd_settime");
 		return -1;
 	}
 	return 0;
 }
 
-static void reset_timer_action(int signo, siginfo_t *si, void *tcontext)
+static int init_timer(struct process *p)
 {
-	init_timer(&process);
+	int tfd;
+
+	if (!has_timer(p))
+		return 0;
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	p->tfd = tfd;
+	return arm_timer(p, __atomic_load_n(p->last, __ATOMIC_RELAXED)+p->timeout);
 }
 
-static int init_signal(const struct process *restrict p)
+/*
+ * Wait until the servers have been idle for the timeout.  The timer
+ * goes off at the deadline of the activity seen last time, and is
+ * pushed to the new deadline if there has been some since.
+ */
+static int wait_timeout(const struct process *restrict p)
 {
-	struct sigaction sa = {.sa_flags = SA_SIGINFO};
+	unsigned long last;
+	uint64_t expired;
+	ssize_t len;
 	int ret;
 
-	/* no timer */
-	if (p->timeout == -1)
-		return 0;
-
-	/* for SIGALRM */
-	ret = sigemptyset(&sa.sa_mask);
-	if (ret == -1) {
-		perror("sigemptyset");
-		return ret;
-	}
-	ret = sigaddset(&sa.sa_mask, SIGUSR1);
-	if (ret == -1) {
-		perror("sigaddset(SIGUSR1)");
-		return ret;
-	}
-	sa.sa_sigaction = timeout_action;
-	ret = sigaction(SIGALRM, &sa, NULL);
-	if (ret == -1) {
-		perror("sigaction(SIGALRM)");
-		return ret;
-	}
-	/* for SIGUSR1 */
-	ret = sigemptyset(&sa.sa_mask);
-	if (ret == -1) {
-		perror("sigemptyset");
-		return ret;
-	}
-	ret = sigaddset(&sa.sa_mask, SIGALRM);
-	if (ret == -1) {
-		perror("sigaddset(SIGALRM)");
-		return ret;
+	if (p->tfd == -1) {
+		for (;;) {
+			ret = pause();
+			if (ret == -1 && errno != EINTR) {
+				perror("pause");
+				return -1;
+			}
+		}
 	}
-	sa.sa_sigaction = reset_timer_action;
-	ret = sigaction(SIGUSR1, &sa, NULL);
-	if (ret == -1) {
-		perror("sigaction(SIGUSR1)");
-		return ret;
+	for (;;) {
+		len = read(p->tfd, &expired, sizeof(expired));
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return -1;
+		}
+		last = __atomic_load_n(p->last, __ATOMIC_RELAXED);
+		if (now_msec()-last >= p->timeout)
+			return 0;
+		ret = arm_timer(p, last+p->timeout);
+		if (ret == -1)
+			return -1;
 	}
-	return 0;
 }
 
 static int init_daemon(const struct process *restrict p)
@@ -532,16 +1433,17 @@ static int init(struct process *p)
 {
 	int ret;
 
-	ret = init_server(p);
+	ret = init_activity(p);
 	if (ret == -1)
 		return ret;
-	ret = init_signal(p);
+	ret = init_server(p);
 	if (ret == -1)
 		return ret;
-	ret = init_timer(p);
+	ret = init_daemon(p);
 	if (ret == -1)
 		return ret;
-	return init_daemon(p);
+	/* after the daemon closed all the descriptors */
+	return init_timer(p);
 }
 
 static void term(const struct process *const p)
@@ -550,16 +1452,26 @@ static void term(const struct process *const p)
 	struct server *s;
 	int i, ret, status;
 
+	if (p->tfd != -1)
+		if (close(p->tfd))
+			perror("close");
 	if (p->ss == NULL)
 		return;
+	/* signal all of them before reaping any */
 	for (i = 0, s = p->ss; i < p->concurrent; i++, s++) {
 		if (s->pid == -1)
 			continue;
 		ret = sigqueue(s->pid, SIGTERM, val);
 		if (ret == -1) {
 			perror("sigqueue");
-			continue;
+			s->pid = -1;
 		}
+	}
+	/* the daemon is not the parent, they are reaped by init(1) */
+	for (i = 0, s = p->ss; p->parent == getpid() && i < p->concurrent;
+	     i++, s++) {
+		if (s->pid == -1)
+			continue;
 		ret = waitpid(s->pid, &status, 0);
 		if (ret == -1)
 			perror("waitpid");
@@ -596,10 +1508,24 @@ int main(int argc, char *const argv[])
 				usage(p, stderr, EXIT_FAILURE);
 			p->concurrent = val;
 			break;
+		case 'e':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > SHRT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->executors = val;
+			break;
 		case 'd':
 			p->output = stderr;
 			p->daemon = 1;
 			break;
+		case 's':
+			p->spawn = 1;
+			break;
+		case 'U':
+			if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+				usage(p, stderr, EXIT_FAILURE);
+			p->path = optarg;
+			break;
 		case 'h':
 			usage(p, stdout, EXIT_SUCCESS);
 			break;
@@ -612,15 +1538,9 @@ int main(int argc, char *const argv[])
 	ret = init(p);
 	if (ret == -1)
 		goto out;
-
-	for (;;) {
-		ret = pause();
-		if (ret == -1) {
-			if (errno == EINTR)
-				continue;
-			perror("pause");
-		}
-	}
+	ret = wait_timeout(p);
+	if (ret == 0)
+		printf("terminating servers\n");
 out:
 	term(p);
 	if (ret)
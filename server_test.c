@@ -50,6 +50,31 @@ int main(void)
 			.argv		= {target, "-c", "1000", "-b", "5", "-t", "1", NULL},
 			.want		= 0,
 		},
+		{
+			.name		= "multi worker 4 executors",
+			.argv		= {target, "-c", "2", "-e", "4", "-t", "1", NULL},
+			.want		= 0,
+		},
+		{
+			.name		= "multi worker posix_spawn executors",
+			.argv		= {target, "-c", "2", "-s", "-t", "1", NULL},
+			.want		= 0,
+		},
+		{
+			.name		= "multi worker Unix domain socket",
+			.argv		= {target, "-c", "2", "-U", "/tmp/server_test.sock", "-t", "1", NULL},
+			.want		= 0,
+		},
+		{
+			.name		= "multi worker abstract Unix domain socket",
+			.argv		= {target, "-c", "2", "-U", "@server_test", "-t", "1", NULL},
+			.want		= 0,
+		},
+		{
+			.name		= "zero executors",
+			.argv		= {target, "-e", "0", "-t", "1", NULL},
+			.want		= 1,
+		},
 		{ .name = NULL }, /* sentry */
 	};
 	int ret = -1;
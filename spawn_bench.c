@@ -0,0 +1,284 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define NR_SWEEP	16	/* values in a sweep list */
+
+/* command spawning backend */
+struct backend {
+	const char		*name;
+	pid_t			(*spawn)(int fd, char *const argv[]);
+};
+
+static struct process {
+	const char		*progname;
+	char			*cmd[2];
+	int			spawns;
+	int			nr_sizes;
+	int			sizes[NR_SWEEP];	/* parent RSS in MiB */
+	const char		*const opts;
+	const struct option	lopts[];
+} proc = {
+	.cmd		= {"true", NULL},
+	.spawns		= 200,
+	.nr_sizes	= 3,
+	.sizes		= {0, 64, 256},
+	.opts		= "c:m:n:h",
+	.lopts		= {
+		{"command",	required_argument,	0,	'c'},
+		{"rss",		required_argument,	0,	'm'},
+		{"spawns",	required_argument,	0,	'n'},
+		{"help",	no_argument,		0,	'h'},
+		{NULL, 0, NULL, 0}, /* sentry */
+	},
+};
+
+static void usage(const struct process *restrict p, FILE *s, int status)
+{
+	const struct option *o;
+	fprintf(s, "usage: %s [-%s]\n", p->progname, p->opts);
+	fprintf(s, "options:\n");
+	for (o = p->lopts; o->name; o++) {
+		fprintf(s, "\t-%c,--%s:", o->val, o->name);
+		switch (o->val) {
+		case 'c':
+			fprintf(s, "\tCommand to spawn, without arguments (default: %s)\n",
+				p->cmd[0]);
+			break;
+		case 'm':
+			fprintf(s, "\t\tComma separated parent RSS in MiB to sweep (default: 0,64,256)\n");
+			break;
+		case 'n':
+			fprintf(s, "\tSpawns per backend and RSS (default: %d)\n",
+				p->spawns);
+			break;
+		case 'h':
+			fprintf(s, "\t\tdisplay this message and exit\n");
+			break;
+		default:
+			fprintf(s, "\t\t%s option\n", o->name);
+			break;
+		}
+	}
+	exit(status);
+}
+
+static unsigned long now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+static int parse_list(const char *arg, int *list, int max)
+{
+	char *end;
+	long val;
+	int nr = 0;
+
+	do {
+		val = strtol(arg, &end, 10);
+		if (end == arg || val < 0 || val > SHRT_MAX || nr == max)
+			return -1;
+		list[nr++] = val;
+		arg = end+1;
+	} while (*end == ',');
+	return *end ? -1 : nr;
+}
+
+/* same as the server's fork(2) path */
+static pid_t fork_command(int fd, char *const argv[])
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		if (dup2(fd, STDOUT_FILENO) == -1) {
+			perror("dup2");
+			_exit(127);
+		}
+		execvp(argv[0], argv);
+		perror("execvp");
+		_exit(127);
+	}
+	return pid;
+}
+
+/* same as the server's posix_spawn(3) path */
+static pid_t spawn_command(int fd, char *const argv[])
+{
+	posix_spawn_file_actions_t fa;
+	pid_t pid = -1;
+	int ret;
+
+	ret = posix_spawn_file_actions_init(&fa);
+	if (ret) {
+		fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(ret));
+		return -1;
+	}
+	ret = posix_spawn_file_actions_adddup2(&fa, fd, STDOUT_FILENO);
+	if (ret) {
+		fprintf(stderr, "posix_spawn_file_actions_adddup2: %s\n", strerror(ret));
+		goto out;
+	}
+	ret = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	if (ret) {
+		fprintf(stderr, "posix_spawnp(%s): %s\n", argv[0], strerror(ret));
+		pid = -1;
+	}
+out:
+	posix_spawn_file_actions_destroy(&fa);
+	return pid;
+}
+
+static const struct backend backends[] = {
+	{.name = "fork",	.spawn = fork_command},
+	{.name = "spawn",	.spawn = spawn_command},
+	{.name = NULL}, /* sentry */
+};
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* spawn and reap the command, latency is up to the child's exit */
+static int run(const struct process *p, const struct backend *b, int fd,
+	       int size, unsigned long *lat)
+{
+	unsigned long start, total = 0;
+	int i, status;
+	pid_t pid;
+
+	for (i = 0; i < p->spawns; i++) {
+		start = now_nsec();
+		pid = b->spawn(fd, p->cmd);
+		if (pid == -1)
+			return -1;
+		if (waitpid(pid, &status, 0) == -1) {
+			perror("waitpid");
+			return -1;
+		}
+		lat[i] = now_nsec()-start;
+		total += lat[i];
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: command failed\n", p->cmd[0]);
+			return -1;
+		}
+	}
+	qsort(lat, p->spawns, sizeof(*lat), compare);
+	printf("%7d %7s %7d %9.1f %9.1f %9.1f %9.1f\n", size, b->name,
+	       p->spawns, total/1000.0/p->spawns,
+	       lat[p->spawns/2]/1000.0, lat[p->spawns*99/100]/1000.0,
+	       lat[p->spawns-1]/1000.0);
+	fflush(stdout);
+	return 0;
+}
+
+static int bench(const struct process *p)
+{
+	const struct backend *b;
+	unsigned long *lat;
+	int i, ret = -1, fd;
+	size_t len;
+	char *mem;
+
+	lat = calloc(p->spawns, sizeof(*lat));
+	if (lat == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+	if (fd == -1) {
+		perror("open(/dev/null)");
+		goto out;
+	}
+	printf("%d spawns of %s, latency in usec\n", p->spawns, p->cmd[0]);
+	printf("%7s %7s %7s %9s %9s %9s %9s\n", "rss(MB)", "backend",
+	       "spawns", "avg", "p50", "p99", "max");
+	for (i = 0; i < p->nr_sizes; i++) {
+		/* grow the parent by touching every page */
+		len = (size_t)p->sizes[i] << 20;
+		mem = NULL;
+		if (len) {
+			mem = mmap(NULL, len, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED) {
+				perror("mmap");
+				goto out;
+			}
+			memset(mem, 1, len);
+		}
+		for (b = backends; b->name; b++)
+			if ((ret = run(p, b, fd, p->sizes[i], lat)) == -1)
+				break;
+		if (mem && munmap(mem, len))
+			perror("munmap");
+		if (ret == -1)
+			goto out;
+	}
+	ret = 0;
+out:
+	if (fd != -1)
+		if (close(fd))
+			perror("close");
+	free(lat);
+	return ret;
+}
+
+int main(int argc, char *const argv[])
+{
+	struct process *p = &proc;
+	int ret, opt;
+
+	p->progname = argv[0];
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, p->opts, p->lopts, NULL)) != -1) {
+		long val;
+		switch (opt) {
+		case 'c':
+			p->cmd[0] = optarg;
+			break;
+		case 'm':
+			ret = parse_list(optarg, p->sizes, NR_SWEEP);
+			if (ret == -1)
+				usage(p, stderr, EXIT_FAILURE);
+			p->nr_sizes = ret;
+			break;
+		case 'n':
+			val = strtol(optarg, NULL, 10);
+			if (val <= 0 || val > INT_MAX)
+				usage(p, stderr, EXIT_FAILURE);
+			p->spawns = val;
+			break;
+		case 'h':
+			usage(p, stdout, EXIT_SUCCESS);
+			break;
+		case '?':
+		default:
+			usage(p, stderr, EXIT_FAILURE);
+			break;
+		}
+	}
+	ret = bench(p);
+	if (ret == -1)
+		return 1;
+	return 0;
+}
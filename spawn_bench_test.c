@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int main(void)
+{
+	char *const target = realpath("./spawn_bench", NULL);
+	const struct test {
+		char	*name;
+		char	*const argv[8];
+		int	want;
+	} *t, tests[] = {
+		{
+			.name	= "-h option",
+			.argv	= {target, "-h", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "0 and 16MiB parent",
+			.argv	= {target, "-m", "0,16", "-n", "10", NULL},
+			.want	= 0,
+		},
+		{
+			.name	= "failing command",
+			.argv	= {target, "-c", "false", "-m", "0", "-n", "1", NULL},
+			.want	= 1,
+		},
+		{
+			.name	= "negative RSS",
+			.argv	= {target, "-m", "-1", NULL},
+			.want	= 1,
+		},
+		{.name = NULL}, /* sentry */
+	};
+	int ret = 0;
+
+	for (t = tests; t->name; t++) {
+		int status;
+		pid_t pid;
+
+		ret = -1;
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			goto out;
+		} else if (pid == 0) {
+			ret = execv(target, t->argv);
+			if (ret == -1) {
+				perror("execv");
+				exit(EXIT_FAILURE);
+			}
+			/* not reachable */
+		}
+		ret = waitpid(pid, &status, 0);
+		if (ret == -1) {
+			perror("waitpid");
+			goto out;
+		}
+		ret = -1;
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "%s: process signaled(%s)\n",
+				t->name, strsignal(WTERMSIG(status)));
+			goto out;
+		}
+		if (!WIFEXITED(status)) {
+			fprintf(stderr, "%s: process does not exit\n",
+				t->name);
+			goto out;
+		}
+		if (WEXITSTATUS(status) != t->want) {
+			fprintf(stderr, "%s: unexpected exit status:\n\t- want: %d\n\t-  got: %d\n",
+				t->name, t->want, WEXITSTATUS(status));
+			goto out;
+		}
+		ret = 0;
+	}
+out:
+	if (target)
+		free(target);
+	return ret;
+}